@@ -3,16 +3,32 @@ QT += qml quick 3drender
 
 CONFIG += c++11
 
+# unchecked voxel accessors are verified with assertions in debug builds only
+CONFIG(release, debug|release): DEFINES += NDEBUG
+
 HEADERS += \
+	src/frame_profile.h \
 	src/math3d.h \
+	src/parallel.h \
 	src/settings.h \
 	src/volume.h \
+	src/volume_cache.h \
+	src/volume_distance.h \
+	src/volume_equalize.h \
 	src/volume_filter.h \
+	src/volume_gradient.h \
+	src/volume_history.h \
+	src/volume_label.h \
+	src/volume_occupancy.h \
+	src/volume_pool.h \
 	src/volume_renderer.h \
+	src/volume_stats.h \
+	src/volume_trace.h \
 	src/volume_quick.h \
 	src/voxel.h \
 	src/voxel_float1.h \
-	src/voxel_float4.h
+	src/voxel_float4.h \
+	src/voxel_normal.h
 
 SOURCES += \
 	#src/volume_image.cpp \
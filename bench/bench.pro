@@ -0,0 +1,27 @@
+QT += qml quick
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = volume_bench
+
+# the measurements are meaningful only for optimized builds
+CONFIG(release, debug|release): DEFINES += NDEBUG
+
+INCLUDEPATH += ../src
+
+HEADERS += \
+	../src/frame_profile.h \
+	../src/parallel.h \
+	../src/volume.h \
+	../src/volume_equalize.h \
+	../src/volume_filter.h \
+	../src/volume_gradient.h \
+	../src/volume_occupancy.h \
+	../src/volume_pool.h \
+	../src/volume_renderer.h \
+	../src/volume_stats.h \
+	../src/volume_trace.h
+
+SOURCES += \
+	../src/volume_renderer.cpp \
+	main.cpp
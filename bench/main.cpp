@@ -0,0 +1,226 @@
+#include "voxel_float1.h"
+#include "voxel_float4.h"
+#include "voxel_normal.h"
+#include "volume_filter.h"
+#include "volume_gradient.h"
+#include "volume_equalize.h"
+#include "volume_stats.h"
+#include "volume_renderer.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRegularExpression>
+#include <QSysInfo>
+#include <QTemporaryDir>
+
+const float1 float1::zero(0);
+const float4 float4::zero(0, 0, 0, 0);
+const normal4 normal4::zero;
+
+// renderer without a window, only the conversion of the volume into texture data is measured
+class BenchRenderer: public VolumeRenderer {
+protected:
+	void requestRender(RenderRequestCause) override {}
+	QSurface *getSurface() override { return nullptr; }
+};
+
+struct Benchmark {
+	QString name;
+	function<void(Volume<float1> &volume)> action;
+};
+
+// deterministic test data: a textured ball with some noise, about two thirds of the voxels are empty
+static void generate(Volume<float1> &volume) {
+	const int width = volume.width();
+	const int height = volume.height();
+	const int depth = volume.depth();
+	parallelFor(0, depth, [&](int begin, int end) {
+		for (int z = begin; z < end; ++z) {
+			for (int y = 0; y < height; ++y) {
+				float1 *row = volume.row(y, z);
+				for (int x = 0; x < width; ++x) {
+					float dx = x / (float) width - .5f;
+					float dy = y / (float) height - .5f;
+					float dz = z / (float) depth - .5f;
+					if (dx * dx + dy * dy + dz * dz > .35f * .35f) {
+						row[x] = float1::zero;
+						continue;
+					}
+					unsigned hash = (x * 73856093u) ^ (y * 19349663u) ^ (z * 83492791u);
+					float noise = (hash % 1024) / 1024.f;
+					float texture = sin(dx * 40) * sin(dy * 40) * sin(dz * 40);
+					row[x].value = .6f + .3f * texture + .1f * noise;
+				}
+			}
+		}
+	});
+}
+
+/**
+ * Run the action `repeat` times, each time on a copy of the input sharing its bricks,
+ * so every run starts from the same data and pays for detaching the modified bricks.
+ */
+static QJsonObject measure(const Benchmark &benchmark, const Volume<float1> &input, int threads, int repeat) {
+	parallelThreads() = threads;
+	vector<double> times;
+	for (int i = 0; i < repeat; ++i) {
+		Volume<float1> volume = input;
+		QElapsedTimer timer;
+		timer.start();
+		benchmark.action(volume);
+		times.push_back(timer.nsecsElapsed() / 1e6);
+	}
+	sort(times.begin(), times.end());
+
+	double mean = 0;
+	for (double time : times) {
+		mean += time / times.size();
+	}
+	double median = times[times.size() / 2];
+	double voxels = (double) input.width() * input.height() * input.depth();
+
+	QJsonObject result;
+	result["name"] = benchmark.name;
+	result["size"] = input.width();
+	result["threads"] = threads;
+	result["repeat"] = repeat;
+	result["min_ms"] = times.front();
+	result["median_ms"] = median;
+	result["mean_ms"] = mean;
+	result["mvoxels_per_s"] = median > 0 ? voxels / median / 1e3 : 0;
+
+	cerr << benchmark.name.toStdString() << "(size: " << input.width() << ", threads: " << threads << "): " << median << " ms" << endl;
+	return result;
+}
+
+static vector<int> parseList(const QString &values) {
+	vector<int> result;
+	for (const QString &value : values.split(',', QString::SkipEmptyParts)) {
+		result.push_back(value.toInt());
+	}
+	return result;
+}
+
+int main(int argc, char *argv[]) {
+	QCoreApplication app(argc, argv);
+	app.setApplicationName("volume_bench");
+
+	const QString cores = QString::number(parallelThreadCount());
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Measure the volume operations, the results are written as json.");
+	parser.addHelpOption();
+	parser.addOptions({
+		{"sizes", "Comma separated list of volume sizes.", "sizes", "64,128,256,512"},
+		{"threads", "Comma separated list of thread counts.", "threads", cores == "1" ? "1" : "1," + cores},
+		{"repeat", "Number of runs of each measurement.", "count", "3"},
+		{"filter", "Run only the benchmarks matching the regular expression.", "regexp", ""},
+		{"label", "Label of the results, like the version of the build.", "label", ""},
+		{"output", "Write the results into the file instead of the standard output.", "file", ""},
+	});
+	parser.process(app);
+
+	const vector<int> sizes = parseList(parser.value("sizes"));
+	const vector<int> threads = parseList(parser.value("threads"));
+	const int repeat = max(1, parser.value("repeat").toInt());
+	const QRegularExpression filter(parser.value("filter"));
+
+	QTemporaryDir temp;
+	if (!temp.isValid()) {
+		cerr << "failed to create temporary directory" << endl;
+		return 1;
+	}
+	const string densePath = temp.filePath("dense.vol").toStdString();
+	const string sparsePath = temp.filePath("sparse.vol").toStdString();
+	const auto sparse = [](float1 value) { return value.value != 0; };
+
+	Kernel<float1> gauss(5);
+	gauss.fillGauss(1.25);
+	Kernel<float1> disk(5);
+	disk.fillDisk(float1(1));
+	Kernel<float1> box(3);
+	box.fill(float1(1));
+	BenchRenderer renderer;
+	float sphere[4] = {.5f, .5f, .5f, .3f};
+
+	const vector<Benchmark> benchmarks = {
+		{"filter.separable", [&](Volume<float1> &volume) { gauss.filter(volume); }},
+		{"filter.generic", [&](Volume<float1> &volume) { disk.filter(volume); }},
+		{"median", [&](Volume<float1> &volume) { box.median(volume); }},
+		{"erode", [&](Volume<float1> &volume) { box.erode(volume); }},
+		{"dilate", [&](Volume<float1> &volume) { box.dilate(volume); }},
+		{"gradient", [](Volume<float1> &volume) {
+			Volume<normal4> result = Volume<normal4>::uninitialized(volume.width(), volume.height(), volume.depth());
+			computeGradient(volume, result, 1);
+		}},
+		{"resize", [](Volume<float1> &volume) {
+			Volume<float1> half = Volume<float1>::uninitialized(volume.width() / 2, volume.height() / 2, volume.depth() / 2);
+			volume.resize(half, ResizeLinear);
+		}},
+		{"clahe", [](Volume<float1> &volume) { equalizeHistogram(volume, 256, 32, 3); }},
+		{"floodFill", [](Volume<float1> &volume) {
+			volume.floodFill(volume.width() / 2, volume.height() / 2, volume.depth() / 2, volume.width(), .2f, float1(0));
+		}},
+		{"normalize", [](Volume<float1> &volume) { normalize(volume); }},
+		{"setVolume", [&](Volume<float1> &volume) {
+			renderer.invalidate();
+			renderer.setVolume(volume, nullptr);
+		}},
+		{"setVolume.sphere", [&](Volume<float1> &volume) {
+			renderer.invalidate();
+			renderer.setVolume(volume, sphere);
+		}},
+		// the runs share the bricks of the input, only the transfer function is updated
+		{"setVolume.unchanged", [&](Volume<float1> &volume) { renderer.setVolume(volume, nullptr); }},
+		{"vol.save", [&](Volume<float1> &volume) { volume.save(densePath); }},
+		{"vol.open", [&](Volume<float1> &volume) { volume.open(densePath); }},
+		{"vol.save.sparse", [&](Volume<float1> &volume) { volume.save(sparsePath, sparse); }},
+		{"vol.open.sparse", [&](Volume<float1> &volume) { volume.open(sparsePath); }},
+	};
+
+	QJsonArray results;
+	for (int size : sizes) {
+		Volume<float1> input(size, size, size);
+		generate(input);
+		// the files are opened by the benchmarks, they must exist before
+		input.save(densePath);
+		input.save(sparsePath, sparse);
+
+		for (const Benchmark &benchmark : benchmarks) {
+			if (!filter.match(benchmark.name).hasMatch()) {
+				continue;
+			}
+			for (int count : threads) {
+				results.append(measure(benchmark, input, count, repeat));
+			}
+		}
+	}
+
+	QJsonObject report;
+	report["label"] = parser.value("label");
+	report["date"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+	report["cpu"] = QSysInfo::currentCpuArchitecture();
+	report["os"] = QSysInfo::prettyProductName();
+	report["cores"] = (int) thread::hardware_concurrency();
+#ifdef __VERSION__
+	report["compiler"] = __VERSION__;
+#endif
+	report["results"] = results;
+
+	QByteArray json = QJsonDocument(report).toJson();
+	if (parser.value("output").isEmpty()) {
+		cout << json.toStdString();
+		return 0;
+	}
+	QFile output(parser.value("output"));
+	if (!output.open(QIODevice::WriteOnly) || output.write(json) != json.size()) {
+		cerr << "failed to write: " << parser.value("output").toStdString() << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -10,6 +10,8 @@ ListView {
 	width: parent.width
 
 	property bool updateOnRelease: false;
+	// statistics of the input volume: min, max, mean, stddev, histogram and percentiles
+	property var statistics: null;
 	property alias count: operationListModel.count;
 	signal valueChanged(variant item, int index, string field);
 
@@ -128,6 +130,76 @@ ListView {
 			}
 		}
 
+		Component {
+			id: distanceComponent
+			OperationItem {
+				text: name
+				width: root.width
+				labelWidth: root.labelWidth
+				spacing: root.spacing
+				enabled: root.get(index).enabled || false
+				updateOnRelease: root.updateOnRelease
+
+				property real threshold: root.get(index).threshold
+				property real radius: root.get(index).radius
+
+				SliderRow {
+					text: 'Threshold'
+					textWidth: parent.labelWidth
+					visible: parent.enabled
+					spacing: parent.spacing
+
+					value: parent.threshold
+					minimumValue: 0
+					maximumValue: 1
+					onValueUpdated: parent.threshold = value
+					updateOnRelease: parent.updateOnRelease
+				}
+
+				SliderRow {
+					text: 'Radius'
+					textWidth: parent.labelWidth
+					visible: parent.enabled
+					spacing: parent.spacing
+
+					value: parent.radius
+					minimumValue: 0
+					maximumValue: 64
+					precision: 1
+					onValueUpdated: parent.radius = value
+					updateOnRelease: parent.updateOnRelease
+				}
+
+				onRemove: root.remove(index)
+				onPreview: root.update(index, field, null)
+				onEnabledChanged: root.enable(index, enabled, completed)
+				onThresholdChanged: root.update(index, 'threshold', threshold, completed)
+				onRadiusChanged: root.update(index, 'radius', radius, completed)
+			}
+		}
+
+		Component {
+			id: componentComponent
+			OperationItemValue {
+				text: name
+				width: root.width
+				labelWidth: root.labelWidth
+				spacing: root.spacing
+				enabled: root.get(index).enabled || false
+				updateOnRelease: root.updateOnRelease
+
+				label: 'Threshold'
+				minimumValue: 0
+				maximumValue: 1
+				value: root.get(index).threshold;
+
+				onRemove: root.remove(index)
+				onPreview: root.update(index, field, null)
+				onEnabledChanged: root.enable(index, enabled, completed)
+				onValueChanged: root.update(index, 'threshold', value, completed)
+			}
+		}
+
 		Component {
 			id: customFilterComponent
 
@@ -223,7 +295,51 @@ ListView {
 				property real min: root.get(index).min
 				property real max: root.get(index).max
 				property bool norm: root.get(index).norm
-				
+
+				Canvas {
+					id: histogram
+					width: parent.width - (parent.leftPadding + parent.rightPadding)
+					height: 48
+					visible: parent.enabled && root.statistics !== null
+
+					property var statistics: root.statistics
+					property real min: parent.min
+					property real max: parent.max
+					onStatisticsChanged: requestPaint()
+					onMinChanged: requestPaint()
+					onMaxChanged: requestPaint()
+
+					onPaint: {
+						var ctx = getContext('2d');
+						ctx.clearRect(0, 0, width, height);
+						if (statistics === null) {
+							return;
+						}
+
+						// selected range
+						ctx.fillStyle = 'rgba(0, 128, 255, 0.2)';
+						ctx.fillRect(Math.min(min, max) * width, 0, Math.abs(max - min) * width, height);
+
+						// histogram with logarithmic scale
+						var bins = statistics.histogram;
+						var peak = 0;
+						for (var i = 0; i < bins.length; ++i) {
+							peak = Math.max(peak, bins[i]);
+						}
+						ctx.fillStyle = 'gray';
+						var scale = Math.log(1 + peak * 1e6);
+						for (var i = 0; i < bins.length; ++i) {
+							var h = height * Math.log(1 + bins[i] * 1e6) / scale;
+							ctx.fillRect(i * width / bins.length, height - h, Math.max(1, width / bins.length), h);
+						}
+					}
+					Label {
+						anchors.right: parent.right
+						anchors.top: parent.top
+						text: parent.statistics === null ? '' : 'mean: ' + parent.statistics.mean.toFixed(3) + ', stddev: ' + parent.statistics.stddev.toFixed(3)
+					}
+				}
+
 				SliderRow {
 					text: 'Minimum'
 					textWidth: parent.labelWidth
@@ -372,6 +488,10 @@ ListView {
 			'Dilate': filterComponent,
 			'Median': filterComponent,
 			'Clahe': claheComponent,
+			'LargestComponent': componentComponent,
+			'ErodeRadius': distanceComponent,
+			'DilateRadius': distanceComponent,
+			'Shell': distanceComponent,
 		}
 		sourceComponent: delegateMap[name] || defaultComponent
 	}
@@ -26,6 +26,10 @@ ApplicationWindow {
 			settings.setValue(null, 'volume.resolution', volumeResolution);
 			settings.setValue(null, 'thumbnail.resolution', 128);
 			settings.setValue(null, 'compute.threads', volume3dData.maxThreads);
+			settings.setValue(null, 'backup.levels', volume3dData.backupLevels);
+			settings.setValue(null, 'undo.memory', volume3dData.undoMemory);
+			settings.setValue(null, 'cache.memory', volume3dData.cacheMemory);
+			settings.setValue(null, 'cache.disk', volume3dData.cacheDisk);
 		}
 
 		if (selection === undefined || selection === 'layout') {
@@ -47,6 +51,8 @@ ApplicationWindow {
 			settings.setValue('view', 'gamma', volume3dView.gamma);
 
 			settings.setValue('view', 'zoom', volume3dView.zoom);
+			settings.setValue('view', 'sampling', volume3dView.sampling);
+			settings.setValue('view', 'frame.target', volume3dView.frameTarget);
 			settings.setValue('view', 'plane', volume3dView.plane);
 
 			settings.setValue('highlight', 'border', volume3dView.highlightBorder);
@@ -88,11 +94,16 @@ ApplicationWindow {
 	Volume3dData {
 		id: volume3dData
 		maxThreads: 1
+		backupLevels: settings.getValue(null, 'backup.levels', 4)
+		undoMemory: settings.getValue(null, 'undo.memory', 512)
+		cacheMemory: settings.getValue(null, 'cache.memory', 1024)
+		cacheDisk: settings.getValue(null, 'cache.disk', 4096)
 
 		onVolumeChanged: {
 			operationLog.d('onVolumeChanged');
 			volume3dView.visible = true;
 			volume3dView.preview();
+			operations.statistics = volume3dData.statistics(128);
 		}
 
 		onOperationStart: {
@@ -124,6 +135,8 @@ ApplicationWindow {
 		alpha: settings.getValue('view', 'alpha', this.getAlpha());
 		plane: settings.getValue('view', 'plane', this.getPlane());
 		zoom: settings.getValue('view', 'zoom', this.getZoom());
+		sampling: settings.getValue('view', 'sampling', this.getSampling());
+		frameTarget: settings.getValue('view', 'frame.target', this.getFrameTarget());
 
 		property int display: Volume3dData.Thumb;
 
@@ -189,7 +202,7 @@ ApplicationWindow {
 		onMouseSelect: {
 			var f = 3;
 			operationLog.d("poscol(r: " + r.toFixed(f) + ", g: " + g.toFixed(f) + ", b: " + b.toFixed(f) + ")");
-			if (btn === Qt.LeftButton) {
+			if (btn === Qt.LeftButton && r >= 0) {
 				selX = r;
 				selY = g;
 				selZ = b;
@@ -304,6 +317,8 @@ ApplicationWindow {
 					volume3dView.display = Volume3dData.Backup;
 					break;
 				case 3:
+					// the gradient of the input, shaded by its direction and magnitude
+					volume3dData.gradient(1);
 					volume3dView.display = Volume3dData.Output;
 					break;
 				case 4:
@@ -432,6 +447,25 @@ ApplicationWindow {
 					maximumValue: 64
 					onValueUpdated: volume3dView.zoom = value;
 				}
+				SliderRow {
+					text: 'Samples'
+					textWidth: labelWidth
+					spacing: root.spacing
+					value: volume3dView.sampling
+					precision: 2
+					minimumValue: .25
+					maximumValue: 4
+					onValueUpdated: volume3dView.sampling = value;
+				}
+				SliderRow {
+					text: 'Frame ms'
+					textWidth: labelWidth
+					spacing: root.spacing
+					value: volume3dView.frameTarget
+					minimumValue: 10
+					maximumValue: 200
+					onValueUpdated: volume3dView.frameTarget = value;
+				}
 				SliderRow {
 					text: 'Alpha'
 					textWidth: labelWidth
@@ -683,6 +717,34 @@ ApplicationWindow {
 									windowSize: 127, bins: 256, clipLimit: 3
 								});
 							}
+							MenuItem {
+								text: 'ErodeRadius'
+								onTriggered: operations.append({
+									name: text, enabled: true,
+									threshold: 0, radius: 2
+								});
+							}
+							MenuItem {
+								text: 'DilateRadius'
+								onTriggered: operations.append({
+									name: text, enabled: true,
+									threshold: 0, radius: 2
+								});
+							}
+							MenuItem {
+								text: 'Shell'
+								onTriggered: operations.append({
+									name: text, enabled: true,
+									threshold: 0, radius: 2
+								});
+							}
+							MenuItem {
+								text: 'LargestComponent'
+								onTriggered: operations.append({
+									name: text, enabled: true,
+									threshold: 0
+								});
+							}
 							MenuItem {
 								text: 'BoxBlur'
 								onTriggered: operations.append({
@@ -783,18 +845,41 @@ ApplicationWindow {
 					Button {
 						text: 'Apply'
 						onClicked: {
+							// volume operations are executed as a list, so the intermediate results can be reused
+							var ops = [];
 							for(var i = 0; i < operations.count; ++i) {
 								var op = operations.get(i);
-								if (op.enabled) {
+								if (!op.enabled) {
+									continue;
+								}
+								if (operations.apply[op.name] !== undefined) {
 									operations.apply[op.name](op);
+									continue;
+								}
+								var newOp = {};
+								for (var k in op) {
+									if (k === 'enabled') {
+										continue;
+									}
+									newOp[k] = op[k];
 								}
+								ops.push(newOp);
 							}
+							volume3dData.apply(ops);
 						}
 					}
 					Button {
 						text: 'Restore'
 						onClicked: volume3dData.restore();
 					}
+					Button {
+						text: 'Undo'
+						onClicked: volume3dData.undo();
+					}
+					Button {
+						text: 'Redo'
+						onClicked: volume3dData.redo();
+					}
 				}
 				OperationList {
 					id: operations
@@ -815,37 +900,8 @@ ApplicationWindow {
 						operations.preview[item.name](display, item, field);
 					}
 
+					// operations not modifying the volume
 					property var apply: {
-						'CropSphere': function(op) {
-							volume3dData.cutCropSphere(op.x, op.y, op.z, op.r, true)
-						},
-						'CutSphere': function(op) {
-							volume3dData.cutCropSphere(op.x, op.y, op.z, op.r, false)
-						},
-						'Threshold': function(op) {
-							volume3dData.threshold(op.min, op.max, op.norm)
-						},
-						'BoxBlur': function(op) {
-							volume3dData.filter(Volume3dData.Filter, op.kernel, op.size, 1 / (op.size * op.size * op.size));
-						},
-						'GaussBlur': function(op) {
-							volume3dData.filter(Volume3dData.Filter, op.kernel, op.size, op.size / 4);
-						},
-						'CustomFilter': function(op) {
-							volume3dData.filter(op.size, op.values);
-						},
-						'Erode': function(op) {
-							volume3dData.filter(Volume3dData.Erode, op.kernel, op.size, 1);
-						},
-						'Dilate': function(op) {
-							volume3dData.filter(Volume3dData.Dilate, op.kernel, op.size, 1);
-						},
-						'Median': function(op) {
-							volume3dData.filter(Volume3dData.Median, op.kernel, op.size, 1);
-						},
-						'Clahe': function(op) {
-							volume3dData.clahe(op.bins, op.windowSize, op.clipLimit);
-						},
 						'RestoreView': function(op) {
 							volume3dView.plane = op.cutPlane;
 							volume3dView.zoom = op.magnify;
@@ -880,6 +936,10 @@ ApplicationWindow {
 						'Dilate': function(quality, op) { volume3dView.preview(Volume3dData.Thumb, false); },
 						'Median': function(quality, op) { volume3dView.preview(Volume3dData.Thumb, false); },
 						'Clahe': function(quality, op) { /* no preview */ },
+						'LargestComponent': function(quality, op) { volume3dView.render(quality, op.threshold); },
+						'ErodeRadius': function(quality, op) { volume3dView.render(quality, op.threshold); },
+						'DilateRadius': function(quality, op) { volume3dView.render(quality, op.threshold); },
+						'Shell': function(quality, op) { volume3dView.render(quality, op.threshold); },
 						'RestoreView': function(quality, op, field) {
 							if (field === 'enabled') {
 								return;
@@ -922,6 +982,106 @@ ApplicationWindow {
 				}
 			}
 		}
+		Tab {
+			title: 'Profile'
+			anchors {
+				fill: parent
+				margins: 12
+			}
+
+			Item {
+				id: profile
+				property var phases: []
+
+				function refresh() {
+					phases = volume3dData.profile();
+				}
+
+				Component.onCompleted: refresh();
+				Connections {
+					target: volume3dData
+					onOperationComplete: profile.refresh();
+				}
+
+				FileDialog {
+					id: saveTraceFile
+					selectExisting: false
+					selectMultiple: false
+					nameFilters: [
+						'Chrome trace (*.json)',
+						'All files (*)'
+					]
+					onSelectionAccepted: volume3dData.saveTrace(fileUrl);
+				}
+
+				Row {
+					id: profileButtons
+					spacing: root.spacing
+					CheckBox {
+						text: 'Record'
+						checked: volume3dData.tracing
+						onClicked: volume3dData.tracing = checked;
+					}
+					Button {
+						text: 'Refresh'
+						onClicked: profile.refresh();
+					}
+					Button {
+						text: 'Clear'
+						onClicked: {
+							volume3dData.clearTrace();
+							profile.refresh();
+						}
+					}
+					Button {
+						text: 'Export'
+						onClicked: saveTraceFile.open();
+					}
+					CheckBox {
+						text: 'Frame overlay'
+						checked: volume3dView.frameOverlay
+						onClicked: volume3dView.frameOverlay = checked;
+					}
+				}
+
+				Text {
+					id: frameTimes
+					anchors {
+						top: profileButtons.bottom
+						topMargin: root.spacing
+					}
+					text: {
+						var times = volume3dView.frameTimes;
+						var result = 'frames (p50 / p95 / p99 ms):';
+						for (var stage in times) {
+							var time = times[stage];
+							if (time.count > 0) {
+								result += '\n  ' + stage + ': ' + time.p50.toFixed(2) + ' / ' + time.p95.toFixed(2) + ' / ' + time.p99.toFixed(2);
+							}
+						}
+						return result;
+					}
+				}
+
+				ListView {
+					clip: true
+					anchors {
+						top: frameTimes.bottom
+						topMargin: root.spacing
+						left: parent.left
+						right: parent.right
+						bottom: parent.bottom
+					}
+					model: profile.phases
+					delegate: Text {
+						text: modelData.name + ': ' + modelData.count + ' x, total: ' + modelData.total.toFixed(1) + ' ms, max: ' + modelData.max.toFixed(1) + ' ms'
+							+ (modelData.voxelsPerSecond > 0 ? ', ' + (modelData.voxelsPerSecond / 1e6).toFixed(1) + ' Mvoxels/s' : '')
+							+ (modelData.utilization > 0 ? ', threads: ' + (modelData.utilization * 100).toFixed(0) + '%' : '')
+							+ (modelData.peak > 0 ? ', peak: ' + modelData.peak.toFixed(0) + ' MB' : '')
+					}
+				}
+			}
+		}
 	}
 
 	StackView {
@@ -0,0 +1,91 @@
+#ifndef FRAME_PROFILE_H
+#define FRAME_PROFILE_H
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Rolling window of the timings of the rendering stages, in milliseconds.
+ * Only the stages which were executed add a sample, a frame which reuses the texture
+ * does not record an upload.
+ * The timings are measured on the cpu, the time the gpu needs to finish the frame is part of the swap.
+ */
+class FrameProfile {
+public:
+	enum Stage {
+		Convert,    // conversion of the volume into texture data (setVolume)
+		Upload,     // upload of the texture
+		Build,      // intersect the slices with the volume
+		Draw,       // clear and draw the slices
+		Swap,       // swap the buffers
+		Frame,      // the whole frame
+		StageCount
+	};
+
+	struct Percentiles {
+		size_t count = 0;
+		double p50 = 0;
+		double p95 = 0;
+		double p99 = 0;
+		double max = 0;
+	};
+
+private:
+	vector<float> samples[StageCount];
+	size_t recorded[StageCount];
+	size_t capacity;
+
+public:
+	explicit FrameProfile(size_t capacity = 256) : capacity(capacity) {
+		clear();
+	}
+
+	static const char *name(Stage stage) {
+		static const char *names[StageCount] = {"convert", "upload", "build", "draw", "swap", "frame"};
+		return names[stage];
+	}
+
+	// milliseconds since an unspecified point, used to measure the stages
+	static double now() {
+		return chrono::duration<double, milli>(chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void add(Stage stage, double time) {
+		vector<float> &values = samples[stage];
+		if (values.size() < capacity) {
+			values.push_back(time);
+		}
+		else {
+			values[recorded[stage] % capacity] = time;
+		}
+		recorded[stage] += 1;
+	}
+
+	void clear() {
+		for (int i = 0; i < StageCount; ++i) {
+			samples[i].clear();
+			recorded[i] = 0;
+		}
+	}
+
+	Percentiles percentiles(Stage stage) const {
+		Percentiles result;
+		vector<float> values = samples[stage];
+		if (values.empty()) {
+			return result;
+		}
+		sort(values.begin(), values.end());
+		const size_t last = values.size() - 1;
+		result.count = values.size();
+		result.p50 = values[last * 50 / 100];
+		result.p95 = values[last * 95 / 100];
+		result.p99 = values[last * 99 / 100];
+		result.max = values[last];
+		return result;
+	}
+};
+
+#endif
@@ -4,6 +4,8 @@
 
 #include <QQmlApplicationEngine>
 #include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QDir>
 #include <QDirIterator>
 #include <QQmlContext>
 #include <QCollator>
@@ -11,20 +13,135 @@
 
 const float1 float1::zero(0);
 const float4 float4::zero(0, 0, 0, 0);
+const normal4 normal4::zero;
 
 static int thumbnailSize = 192;
 static int volumeResolution = 512;
 
+// nearest neighbour resize of the kernel into the slices [zmin, zmax) of the volume
+static void resizeSlices(const Kernel<float1> &kernel, Volume<float1> &volume, int zmin, int zmax) {
+	const int width = volume.width();
+	const int height = volume.height();
+	const int depth = volume.depth();
+	vector<int> kx(width);
+	for (int x = 0; x < width; ++x) {
+		kx[x] = (int) ((x + .5) * kernel.width() / width);
+	}
+	volume.detach(zmin, zmax, false);
+	parallelFor(zmin, zmax, [&](int begin, int end) {
+		for (int z = begin; z < end; ++z) {
+			const int kz = (int) ((z + .5) * kernel.depth() / depth);
+			for (int y = 0; y < height; ++y) {
+				const float1 *src = kernel.row((int) ((y + .5) * kernel.height() / height), kz);
+				float1 *dst = volume.row(y, z);
+				for (int x = 0; x < width; ++x) {
+					dst[x] = src[kx[x]];
+				}
+			}
+		}
+	});
+}
+
 VolumeData::VolumeData(): VolumeData(volumeResolution, thumbnailSize) {
-	this->start("init", [this]() {
+	// the window is shown with the empty volumes, opening a file before the demo data is ready cancels it
+	this->start("demo", [this]() {
 		constexpr int size = 25;
 		constexpr double sigma = size / 5.;
-		Kernel<float1>(size).fillGauss(sigma, 2, 0, -1).resize(this->input, 0);
-		Kernel<float1>(size).fillGauss(sigma, 0, 2, -1).resize(this->saved, 0);
+		Kernel<float1> inputKernel(size);
+		Kernel<float1> savedKernel(size);
+		inputKernel.fillGauss(sigma, 2, 0, -1);
+		savedKernel.fillGauss(sigma, 0, 2, -1);
+
+		Volume<float1> input = Volume<float1>::uninitialized(this->input.width(), this->input.height(), this->input.depth());
+		Volume<float1> saved = Volume<float1>::uninitialized(this->saved.width(), this->saved.height(), this->saved.depth());
+		for (unsigned brick = 0; brick < input.brickCount(); ++brick) {
+			if (cancelled()) {
+				log() << "demo cancelled";
+				return;
+			}
+			const int zmin = input.brickSlice(brick);
+			const int zmax = zmin + input.brickDepth(brick);
+			resizeSlices(inputKernel, input, zmin, zmax);
+			resizeSlices(savedKernel, saved, zmin, zmax);
+		}
+		this->input.assign(input);
+		this->saved.assign(saved);
 		onInputChanged();
 	});
 }
 
+// the volumes of the command line, without the demo data of the window
+class BatchData: public VolumeData {
+public:
+	BatchData(): VolumeData(volumeResolution, thumbnailSize) {}
+};
+
+// renderer of the command line, it draws only offscreen
+class BatchRenderer: public VolumeRenderer {
+public:
+	BatchRenderer(qreal threshold, qreal alpha, float zoom, float tilt) {
+		reset();
+		this->threshold = static_cast<int>(threshold * 255);
+		this->alpha = static_cast<int>(alpha * 255);
+		this->vol3dZoom = zoom;
+		this->vol3dTransform *= rotation(deg2rad(tilt), vector3d(1, 0, 0));
+	}
+
+protected:
+	void requestRender(RenderRequestCause cause) override {
+		if (cause == ModelChanged) {
+			_resetModel = true;
+		}
+	}
+	QSurface *getSurface() override { return nullptr; }
+};
+
+/**
+ * Render the frames of a turntable of the volume given on the command line, without showing the window.
+ */
+static int turntable(const QCommandLineParser &parser) {
+	const QStringList files = parser.positionalArguments();
+	if (files.size() != 1) {
+		cerr << "the turntable needs one volume" << endl;
+		return 1;
+	}
+	const QString output = parser.value("turntable");
+	if (!QDir().mkpath(output)) {
+		cerr << "failed to create directory: " << output.toStdString() << endl;
+		return 1;
+	}
+
+	BatchData data;
+	atomic<bool> failed(false);
+	QObject::connect(&data, &VolumeData::operationFailed, [&failed](qint64, QString) {
+		failed = true;
+	});
+	data.open(QUrl::fromLocalFile(files[0]), parser.value("slices").toInt());
+	data.join();
+	if (failed) {
+		return 1;
+	}
+
+	BatchRenderer renderer(parser.value("threshold").toDouble(), parser.value("alpha").toDouble(),
+		parser.value("zoom").toFloat(), parser.value("tilt").toFloat());
+	data.updateVolume(&renderer, VolumeData::Input, nullptr);
+
+	const QStringList size = parser.value("size").split('x');
+	const int width = size.value(0).toInt();
+	const int height = size.value(size.size() > 1 ? 1 : 0).toInt();
+	const int frames = parser.value("frames").toInt();
+	if (width <= 0 || height <= 0 || frames <= 0) {
+		cerr << "invalid size or frame count" << endl;
+		return 1;
+	}
+	const QString path = QDir(output).filePath("frame_%1.png");
+	if (!renderer.renderTurntable(path, width, height, frames, parser.value("degrees").toFloat())) {
+		return 1;
+	}
+	cerr << frames << " frames saved: " << output.toStdString() << endl;
+	return 0;
+}
+
 int main(int argc, char *argv[]) {
 	QGuiApplication::setAttribute(Qt::AA_EnableHighDpiScaling);
 
@@ -37,6 +154,26 @@ int main(int argc, char *argv[]) {
 	volumeResolution = settings.getValue(nullptr, "volume.resolution", volumeResolution).toInt();
 	thumbnailSize = settings.getValue(nullptr, "thumbnail.resolution", thumbnailSize).toInt();
 
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Volume viewer, the turntable is rendered without showing the window (use -platform offscreen on headless machines).");
+	parser.addHelpOption();
+	parser.addPositionalArgument("volume", "Volume or first image of the slices rendered into the turntable.");
+	parser.addOptions({
+		{"turntable", "Render the frames of a turntable into the directory and exit.", "directory"},
+		{"frames", "Number of frames of the turntable.", "count", "120"},
+		{"degrees", "Rotation around the vertical axis during the turntable.", "degrees", "360"},
+		{"tilt", "Rotation around the horizontal axis before the turntable.", "degrees", "20"},
+		{"size", "Size of the frames.", "width[xheight]", "512x512"},
+		{"slices", "Number of slices read from the images, 0 reads all of them.", "count", "0"},
+		{"threshold", "Values up to the threshold are transparent, from 0 to 1.", "value", "0"},
+		{"alpha", "Opacity of the values, from 0 to 1.", "value", "1"},
+		{"zoom", "Zoom of the volume.", "value", "1"},
+	});
+	parser.process(app);
+	if (parser.isSet("turntable")) {
+		return turntable(parser);
+	}
+
 	qmlRegisterType<VolumeWindow>("VolumeRenderer", 1, 0, "Volume3dWindow");
 	qmlRegisterType<VolumeData>("VolumeRenderer", 1, 0, "Volume3dData");
 
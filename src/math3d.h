@@ -352,6 +352,40 @@ static inline matrix3d translate(scalar cnt, const vector3d &dir) {
 	return result;
 }
 
+// inverse of the matrix using gauss-jordan elimination, the matrix must not be singular
+static inline matrix3d inverse(const matrix3d &src) {
+	matrix3d lhs = src;
+	matrix3d result(1);
+	for (int col = 0; col < 4; ++col) {
+		int pivot = col;
+		for (int row = col + 1; row < 4; ++row) {
+			if (fabsf(lhs[row][col]) > fabsf(lhs[pivot][col])) {
+				pivot = row;
+			}
+		}
+		if (pivot != col) {
+			vector3d tmp = lhs[col];
+			lhs[col] = lhs[pivot];
+			lhs[pivot] = tmp;
+			tmp = result[col];
+			result[col] = result[pivot];
+			result[pivot] = tmp;
+		}
+
+		scalar div = 1 / lhs[col][col];
+		lhs[col] *= div;
+		result[col] *= div;
+		for (int row = 0; row < 4; ++row) {
+			if (row != col) {
+				scalar mul = lhs[row][col];
+				lhs[row] -= lhs[col] * mul;
+				result[row] -= result[col] * mul;
+			}
+		}
+	}
+	return result;
+}
+
 /*
 static inline void ortho_mat(matrix3d dst, scalar l, scalar r, scalar b, scalar t, scalar n, scalar f) {
 	scalar rl = r - l;
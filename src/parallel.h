@@ -0,0 +1,103 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <functional>
+
+#include "volume_trace.h"
+
+using namespace std;
+
+// number of threads used to split the work of a single operation, 0 means use all the cores
+inline unsigned &parallelThreads() {
+	static unsigned threads = 0;
+	return threads;
+}
+
+static inline unsigned parallelThreadCount() {
+	unsigned threads = parallelThreads();
+	if (threads == 0) {
+		threads = thread::hardware_concurrency();
+	}
+	return threads > 0 ? threads : 1;
+}
+
+/**
+ * Execute action on the range [begin, end) split into chunks of at least `grain` elements.
+ * The chunks are distributed dynamically between the threads, the calling thread also takes part.
+ * The first exception thrown by the action is re-thrown after all the threads are finished.
+ */
+static inline void parallelFor(int begin, int end, const function<void(int begin, int end)> &action, int grain = 1) {
+	if (begin >= end) {
+		return;
+	}
+	const int count = end - begin;
+	unsigned threads = parallelThreadCount();
+	if (threads > (unsigned) (count + grain - 1) / grain) {
+		threads = (count + grain - 1) / grain;
+	}
+	// the utilization of the threads is added to the enclosing trace scope
+	const bool traced = TraceScope::tracing();
+	const int64_t started = traced ? VolumeTrace::instance().now() : 0;
+	if (threads <= 1) {
+		action(begin, end);
+		if (traced) {
+			double elapsed = VolumeTrace::instance().now() - started;
+			TraceScope::parallel(elapsed, elapsed);
+		}
+		return;
+	}
+
+	int chunk = count / (threads * 4);
+	if (chunk < grain) {
+		chunk = grain;
+	}
+
+	atomic<int> next(begin);
+	exception_ptr error = nullptr;
+	atomic_flag failed = ATOMIC_FLAG_INIT;
+	atomic<int64_t> busy(0);
+	auto worker = [&]() {
+		try {
+			for (;;) {
+				int from = next.fetch_add(chunk);
+				if (from >= end) {
+					break;
+				}
+				int64_t time = traced ? VolumeTrace::instance().now() : 0;
+				action(from, from + chunk < end ? from + chunk : end);
+				if (traced) {
+					busy += VolumeTrace::instance().now() - time;
+				}
+			}
+		} catch (...) {
+			if (!failed.test_and_set()) {
+				error = current_exception();
+			}
+			// skip the remaining chunks
+			next = end;
+		}
+	};
+
+	vector<thread> workers;
+	workers.reserve(threads - 1);
+	for (unsigned i = 1; i < threads; ++i) {
+		workers.emplace_back(worker);
+	}
+	worker();
+	for (thread &t : workers) {
+		t.join();
+	}
+	if (traced) {
+		double elapsed = VolumeTrace::instance().now() - started;
+		TraceScope::parallel(busy, elapsed * threads);
+	}
+	if (error != nullptr) {
+		rethrow_exception(error);
+	}
+}
+
+#endif
@@ -2,11 +2,16 @@
 #define VOLUME_H
 
 #include <cmath>
+#include <cassert>
 #include <fstream>
 #include <iostream>
 #include <algorithm>
 #include <functional>
-#include <stack>
+#include <memory>
+#include <vector>
+
+#include "parallel.h"
+#include "volume_pool.h"
 
 #define dbgVolume(__MSG) do { /*cout << (__MSG) << endl;*/ } while(false)
 
@@ -73,63 +78,267 @@ struct aabbox {
 	}
 };
 
+// raw view of a box inside a volume: pointers to the slices, offset of the box and stride of the rows
+template <class voxel> struct VolumeView {
+	voxel *const *slices;
+	size_t offset;
+	size_t strideY;
+	int sx, sy, sz;
+
+	inline int width() const { return sx; }
+
+	inline int height() const { return sy; }
+
+	inline int depth() const { return sz; }
+
+	// pointer to the first voxel of the row, the voxels of a row are contiguous
+	inline voxel *row(int y, int z) const {
+		assert(static_cast<unsigned>(y) < static_cast<unsigned>(this->sy));
+		assert(static_cast<unsigned>(z) < static_cast<unsigned>(this->sz));
+		return this->slices[z] + this->offset + y * this->strideY;
+	}
+
+	inline voxel &at(int x, int y, int z) const {
+		assert(static_cast<unsigned>(x) < static_cast<unsigned>(this->sx));
+		return this->row(y, z)[x];
+	}
+};
+
+// resampling filter used to resize volumes
+enum ResizeFilter {
+	ResizeNearest,	// nearest neighbour, used to copy volumes of the same size
+	ResizeLinear,	// linear when upscaling, area average when downscaling
+	ResizeCubic,	// Catmull-Rom when upscaling
+	ResizeLanczos	// Lanczos (a = 3) when upscaling
+};
+
+// weights of the source elements contributing to each destination element of a resampled axis
+struct ResizeWeights {
+	vector<int> first;		// first source element for each destination element
+	vector<int> count;		// number of source elements for each destination element
+	vector<float> weights;	// `taps` weights for each destination element
+	int taps;
+
+	ResizeWeights(int src, int dst, ResizeFilter filter)
+		: first(dst), count(dst), taps(1) {
+		const double scale = dst / (double) src;
+		double radius = 0.5;
+		switch (filter) {
+			case ResizeNearest:
+				radius = 0.5;
+				break;
+			case ResizeLinear:
+				radius = scale < 1 ? 0.5 : 1;
+				break;
+			case ResizeCubic:
+				radius = 2;
+				break;
+			case ResizeLanczos:
+				radius = 3;
+				break;
+		}
+
+		// when downscaling the filter is stretched to cover all the source elements
+		const double support = scale < 1 && filter != ResizeNearest ? radius / scale : radius;
+		taps = filter == ResizeNearest ? 1 : static_cast<int>(ceil(support * 2)) + 1;
+		weights.resize((size_t) dst * taps);
+
+		for (int i = 0; i < dst; ++i) {
+			float *w = &weights[(size_t) i * taps];
+			for (int t = 0; t < taps; ++t) {
+				w[t] = 0;
+			}
+
+			if (filter == ResizeNearest) {
+				int j = static_cast<int>((i + .5) / scale);
+				first[i] = j < src ? j : src - 1;
+				count[i] = 1;
+				w[0] = 1;
+				continue;
+			}
+
+			// center of the destination element in source coordinates
+			const double center = (i + .5) / scale - .5;
+			int lo = static_cast<int>(floor(center - support + 1));
+			int hi = static_cast<int>(ceil(center + support - 1));
+			if (filter == ResizeLinear && scale < 1) {
+				// area of the source elements covered by the destination element
+				lo = static_cast<int>(floor(i / scale));
+				hi = static_cast<int>(ceil((i + 1) / scale)) - 1;
+			}
+
+			first[i] = max(0, min(lo, src - 1));
+			count[i] = max(1, min(hi, src - 1) - first[i] + 1);
+			if (count[i] > taps) {
+				count[i] = taps;
+			}
+
+			double sum = 0;
+			for (int j = lo; j <= hi; ++j) {
+				double weight;
+				if (filter == ResizeLinear && scale < 1) {
+					weight = min((double) j + 1, (i + 1) / scale) - max((double) j, i / scale);
+				}
+				else {
+					double x = j - center;
+					if (scale < 1) {
+						x *= scale;
+					}
+					weight = kernel(filter, x);
+				}
+
+				// clamp to edge
+				int k = max(0, min(j, src - 1)) - first[i];
+				if (k < 0 || k >= count[i]) {
+					continue;
+				}
+				w[k] += weight;
+				sum += weight;
+			}
+
+			if (sum != 0) {
+				for (int k = 0; k < count[i]; ++k) {
+					w[k] /= sum;
+				}
+			}
+		}
+	}
+
+	static double kernel(ResizeFilter filter, double x) {
+		static const double PI = 3.14159265358979323846;
+		x = abs(x);
+		switch (filter) {
+			case ResizeNearest:
+				return x < .5 ? 1 : 0;
+
+			case ResizeLinear:
+				return x < 1 ? 1 - x : 0;
+
+			case ResizeCubic:
+				if (x < 1) {
+					return (1.5 * x - 2.5) * x * x + 1;
+				}
+				if (x < 2) {
+					return ((-.5 * x + 2.5) * x - 4) * x + 2;
+				}
+				return 0;
+
+			case ResizeLanczos:
+				if (x < 1e-8) {
+					return 1;
+				}
+				if (x < 3) {
+					return 3 * sin(PI * x) * sin(PI * x / 3) / (PI * PI * x * x);
+				}
+				return 0;
+		}
+		return 0;
+	}
+};
+
 template <class voxel> class Volume {
 protected:
+	// number of consecutive slices stored in a brick
+	enum { BrickSlices = 8 };
+
 	// dimensions
 	const unsigned sx, sy, sz;
-
-	// positions of sparse elements (if null, not sparse)
-	//size_t *positions = nullptr;
-	voxel *voxels;
 	size_t count;
 
-	// map the position of x, y, z to the index of the array
-	size_t position(int x, int y, int z) const {
-		static const size_t invalid = static_cast<size_t>(-1);
-		if (static_cast<unsigned>(x) >= this->sx) {
-			return invalid;
-		}
-		if (static_cast<unsigned>(y) >= this->sy) {
-			return invalid;
+	// the voxels are stored in bricks of consecutive slices, which are shared
+	// between the copies of the volume and are copied only when modified
+	vector<shared_ptr<voxel>> bricks;
+
+	// pointer to the first voxel of each slice
+	vector<voxel *> slices;
+
+	// map the position of x, y, z to the index inside the slice without checking the bounds
+	inline size_t offset(int x, int y, int z) const {
+		assert(this->contains(x, y, z));
+		return x + (size_t) this->sx * y;
+	}
+
+	unsigned maxDim() {
+		return (sx > sy) ? (sx > sz ? sx : sz) : (sy > sz ? sy : sz);
+	}
+
+	// the bricks are taken from the pool without running the constructors of the voxels
+	static_assert(is_trivially_destructible<voxel>::value, "voxels must be trivially destructible");
+
+	// replace the brick with a new one from the pool, preserving the content if requested
+	void detachBrick(unsigned brick, bool preserve) {
+		const size_t sliceSize = (size_t) this->sx * this->sy;
+		const size_t size = sliceSize * brickDepth(brick);
+		const size_t bytes = size * sizeof(voxel);
+		voxel *data = (voxel *) VolumePool::instance().allocate(bytes);
+		if (preserve) {
+			const voxel *src = this->bricks[brick].get();
+			copy(src, src + size, data);
+		}
+		this->bricks[brick] = shared_ptr<voxel>(data, [bytes](voxel *data) {
+			VolumePool::instance().release(data, bytes);
+		});
+		for (unsigned i = 0; i < brickDepth(brick); ++i) {
+			this->slices[brick * BrickSlices + i] = data + i * sliceSize;
 		}
-		if (static_cast<unsigned>(z) >= this->sz) {
-			return invalid;
-		}
-		size_t position = x + (this->sx * (y + this->sy * z));
-		/*if (this->positions != nullptr) {
-			// if the volume is sparse, do binary search
-			size_t *lo = this->positions;
-			size_t *hi = lo + this->count;
-
-			while (lo < hi) {
-				size_t *mid = lo + (hi - lo) / 2;
-				if (position == *mid) {
-					return mid - this->positions;
-				}
-				if (position > *mid) {
-					lo = mid + 1;
-				}
-				else {
-					hi = mid;
+	}
+
+	Volume(unsigned x, unsigned y, unsigned z, bool initialize)
+		: sx(x), sy(y), sz(z), count((size_t) x * y * z)
+		, bricks((z + BrickSlices - 1) / BrickSlices), slices(z) {
+		dbgVolume("ctr.new.vol(sx, sy, sz, initialize)");
+		const size_t sliceSize = (size_t) x * y;
+		parallelFor(0, this->bricks.size(), [&](int begin, int end) {
+			for (int brick = begin; brick < end; ++brick) {
+				detachBrick(brick, false);
+				if (initialize) {
+					voxel *data = this->bricks[brick].get();
+					std::fill(data, data + sliceSize * brickDepth(brick), voxel());
 				}
 			}
-			return invalid;
-		}*/
-		return position;
+		});
 	}
 
-	unsigned maxDim() {
-		return (sx > sy) ? (sx > sz ? sx : sz) : (sy > sz ? sy : sz);
+	// all the bricks share the given one, which must hold at least a full brick
+	Volume(unsigned x, unsigned y, unsigned z, const shared_ptr<voxel> &brick)
+		: sx(x), sy(y), sz(z), count((size_t) x * y * z)
+		, bricks((z + BrickSlices - 1) / BrickSlices, brick), slices(z) {
+		dbgVolume("ctr.new.vol(sx, sy, sz, brick)");
+		for (unsigned i = 0; i < z; ++i) {
+			this->slices[i] = brick.get() + (i % BrickSlices) * (size_t) x * y;
+		}
 	}
 
 public:
 	/**
-	 * Construct a new volume with the given dimensions
+	 * Construct a new volume with the given dimensions, the voxels are value initialized
 	 */
 	Volume(unsigned x, unsigned y, unsigned z)
-		: sx(x), sy(y), sz(z), count((size_t) x * y * z) {
-		dbgVolume("ctr.new.vol(sx, sy, sz)");
-		this->voxels = new voxel[this->count];
+		: Volume(x, y, z, true) {
+	}
+
+	/**
+	 * Construct a new volume with the given dimensions without initializing the voxels,
+	 * for volumes which are completely written, like the output of an operation.
+	 */
+	static Volume uninitialized(unsigned x, unsigned y, unsigned z) {
+		return Volume(x, y, z, false);
+	}
+
+	/**
+	 * Construct a new volume with value initialized voxels, allocating memory only for a single brick.
+	 * The bricks share it until they are written, like the bricks of a copy,
+	 * so the writers from multiple threads must detach the written slices first.
+	 */
+	static Volume zeros(unsigned x, unsigned y, unsigned z) {
+		const size_t size = (size_t) x * y * min(z, (unsigned) BrickSlices);
+		const size_t bytes = size * sizeof(voxel);
+		voxel *data = (voxel *) VolumePool::instance().allocate(bytes);
+		std::fill(data, data + size, voxel());
+		shared_ptr<voxel> brick(data, [bytes](voxel *data) {
+			VolumePool::instance().release(data, bytes);
+		});
+		return Volume(x, y, z, brick);
 	}
 
 	/**
@@ -141,26 +350,19 @@ public:
 	}
 
 	/**
-	 * Construct a new volume and copy data
-	 * the new volume will be not sparse, neither if the copied one is.
+	 * Construct a new volume sharing the voxels of the copied one,
+	 * bricks are copied only when one of the volumes is modified.
 	 */
 	Volume(const Volume &copy)
-		: Volume(copy.sx, copy.sy, copy.sz) {
+		: sx(copy.sx), sy(copy.sy), sz(copy.sz), count(copy.count)
+		, bricks(copy.bricks), slices(copy.slices) {
 		dbgVolume("ctr.cpy.vol");
-		for (size_t pos = 0; pos < copy.count; ++pos) {
-			this->voxels[pos] = copy.voxels[pos];
-		}
 	}
 
 	Volume(Volume &&move) noexcept
-		: sx(move.sx), sy(move.sy), sz(move.sz), count(move.count) {
+		: sx(move.sx), sy(move.sy), sz(move.sz), count(move.count)
+		, bricks(std::move(move.bricks)), slices(std::move(move.slices)) {
 		dbgVolume("ctr.mov.vol");
-
-		this->voxels = move.voxels;
-		move.voxels = nullptr;
-
-		this->positions = move.positions;
-		move.positions = nullptr;
 	}
 
 	/**
@@ -168,7 +370,64 @@ public:
 	 */
 	virtual ~Volume() {
 		dbgVolume("dtr.vol");
-		delete[] this->voxels;
+	}
+
+	/**
+	 * Share the voxels of the other volume, the previous content is released.
+	 * If the dimensions are different the other volume is resampled.
+	 */
+	void assign(const Volume &other) {
+		if (other.sx != this->sx || other.sy != this->sy || other.sz != this->sz) {
+			other.resize(*this, ResizeLinear);
+			return;
+		}
+		this->bricks = other.bricks;
+		this->slices = other.slices;
+	}
+
+	/**
+	 * Prepare the slices [zmin, zmax) for writing: the bricks shared with other volumes are copied.
+	 * Writing the same brick from multiple threads is safe only after the bricks were detached.
+	 * If the content is not preserved the shared bricks are replaced with uninitialized ones.
+	 */
+	void detach(int zmin, int zmax, bool preserve = true) {
+		if (zmin < 0) {
+			zmin = 0;
+		}
+		if (zmax > this->depth()) {
+			zmax = this->depth();
+		}
+		for (int z = zmin; z < zmax; z = (z / BrickSlices + 1) * BrickSlices) {
+			unsigned brick = z / BrickSlices;
+			if (this->bricks[brick].use_count() > 1) {
+				detachBrick(brick, preserve);
+			}
+		}
+	}
+
+	void detach() {
+		detach(0, this->depth());
+	}
+
+	// number of bricks, the slices of a brick are stored contiguously
+	inline unsigned brickCount() const {
+		return this->bricks.size();
+	}
+
+	// first slice stored in the brick
+	inline int brickSlice(unsigned brick) const {
+		return brick * BrickSlices;
+	}
+
+	// number of slices stored in the brick
+	inline unsigned brickDepth(unsigned brick) const {
+		unsigned z = brick * BrickSlices;
+		return z + BrickSlices < this->sz ? (unsigned) BrickSlices : this->sz - z;
+	}
+
+	// check if the brick is shared with the other volume (not modified since copied)
+	inline bool sharesBrick(const Volume &other, unsigned brick) const {
+		return this->bricks[brick] == other.bricks[brick];
 	}
 
 	void save(const string &fileName, const function<bool(voxel value)> &sparse = nullptr) {
@@ -179,15 +438,20 @@ public:
 
 		uint16_t sx = this->sx, sy = this->sy, sz = this->sz;
 		uint64_t count = this->count;
+		const size_t sliceSize = (size_t) sx * sy;
+		const Volume &self = *this;
 
 		size_t *positions = nullptr;
 		if (sparse != nullptr) {
 			count = 0;
 			positions = new size_t[this->count];
-			for (size_t pos = 0; pos < this->count; ++pos) {
-				if (sparse(this->voxels[pos])) {
-					positions[count] = pos;
-					count += 1;
+			for (size_t z = 0; z < sz; ++z) {
+				const voxel *slice = self.slice(z);
+				for (size_t pos = 0; pos < sliceSize; ++pos) {
+					if (sparse(slice[pos])) {
+						positions[count] = z * sliceSize + pos;
+						count += 1;
+					}
 				}
 			}
 		}
@@ -197,14 +461,17 @@ public:
 		out.write((char *) &sz, sizeof(sz));
 		out.write((char *) &count, sizeof(count));
 
-		if (count < (size_t) sx * sy * sx) {
+		if (count < (size_t) sx * sy * sz) {
 			out.write((char *) positions, count * sizeof(*positions));
 			for (size_t pos = 0; pos < count; ++pos) {
-				this->voxels[positions[pos]].write(out);
+				self.slice(positions[pos] / sliceSize)[positions[pos] % sliceSize].write(out);
 			}
 		} else {
-			for (size_t pos = 0; pos < count; ++pos) {
-				this->voxels[pos].write(out);
+			for (size_t z = 0; z < sz; ++z) {
+				const voxel *slice = self.slice(z);
+				for (size_t pos = 0; pos < sliceSize; ++pos) {
+					slice[pos].write(out);
+				}
 			}
 		}
 
@@ -230,23 +497,27 @@ public:
 			resize = new Volume(sx, sy, sz);
 		}
 
+		const size_t sliceSize = (size_t) sx * sy;
 		resize->fill(voxel::zero);
 		if (count < (size_t) sx * sy * sz) {
 			size_t *positions = new size_t[count];
 			in.read((char *) positions, count * sizeof(*positions));
 			for (size_t pos = 0; pos < count; ++pos) {
-				resize->voxels[positions[pos]].read(in);
+				resize->slice(positions[pos] / sliceSize)[positions[pos] % sliceSize].read(in);
 			}
 			delete[] positions;
 		}
 		else {
-			for (size_t pos = 0; pos < count; ++pos) {
-				resize->voxels[pos].read(in);
+			for (size_t z = 0; z < sz; ++z) {
+				voxel *slice = resize->slice(z);
+				for (size_t pos = 0; pos < sliceSize; ++pos) {
+					slice[pos].read(in);
+				}
 			}
 		}
 
 		if (resize != this) {
-			resize->resize(*this, 1);
+			resize->resize(*this, ResizeLinear);
 			delete resize;
 		}
 	}
@@ -260,47 +531,119 @@ public:
 	inline unsigned voxelCount() const { return sx * sy * sz; }
 
 	voxel get(int x, int y, int z) const {
-		size_t position = this->position(x, y, z);
-		if (position >= this->count) {
+		if (!this->contains(x, y, z)) {
 			return voxel::zero;
 		}
-		return this->voxels[position];
+		return this->slices[z][this->offset(x, y, z)];
 	}
 
 	void set(int x, int y, int z, voxel value) {
-		size_t position = this->position(x, y, z);
-		if (position >= this->count) {
+		if (!this->contains(x, y, z)) {
 			return;
 		}
-		this->voxels[position] = value;
+		this->slice(z)[this->offset(x, y, z)] = value;
 	}
 
-	void fill(voxel value) {
-		for (size_t i = 0; i < this->count; ++i) {
-			this->voxels[i] = value;
+	inline bool contains(int x, int y, int z) const {
+		if (static_cast<unsigned>(x) >= this->sx) {
+			return false;
 		}
+		if (static_cast<unsigned>(y) >= this->sy) {
+			return false;
+		}
+		if (static_cast<unsigned>(z) >= this->sz) {
+			return false;
+		}
+		return true;
 	}
 
-	void floodFill(int x, int y, int z, int max, float threshold, voxel fill) {
-		static const int dx[6] = {0, 0, 1, 0, 0, -1}; // relative neighbor x coordinates
-		static const int dy[6] = {0, 1, 0, 0, -1, 0}; // relative neighbor y coordinates
-		static const int dz[6] = {1, 0, 0, -1, 0, 0}; // relative neighbor z coordinates
+	/**
+	 * Unchecked access to a voxel, coordinates are verified only in debug builds.
+	 */
+	inline const voxel &at(int x, int y, int z) const {
+		return this->slices[z][this->offset(x, y, z)];
+	}
 
-		const int ox = x;
-		const int oy = y;
-		const int oz = z;
+	inline voxel &at(int x, int y, int z) {
+		return this->slice(z)[this->offset(x, y, z)];
+	}
 
-		const unsigned sx = this->width();
-		const unsigned sy = this->height();
-		const unsigned sz = this->depth();
+	/**
+	 * Pointer to the first voxel of a row, the next `width()` voxels are contiguous.
+	 */
+	inline const voxel *row(int y, int z) const {
+		return this->slices[z] + this->offset(0, y, z);
+	}
 
-		if (static_cast<unsigned>(x) >= sx) {
-			return;
+	inline voxel *row(int y, int z) {
+		return this->slice(z) + this->offset(0, y, z);
+	}
+
+	/**
+	 * Pointer to the first voxel of a slice, rows follow each other with a stride of `width()`.
+	 * Writable slices are copied first if the brick is shared with other volumes.
+	 */
+	inline const voxel *slice(int z) const {
+		assert(static_cast<unsigned>(z) < this->sz);
+		return this->slices[z];
+	}
+
+	inline voxel *slice(int z) {
+		assert(static_cast<unsigned>(z) < this->sz);
+		if (this->bricks[z / BrickSlices].use_count() > 1) {
+			detachBrick(z / BrickSlices, true);
 		}
-		if (static_cast<unsigned>(y) >= sy) {
-			return;
+		return this->slices[z];
+	}
+
+	/**
+	 * View of a box (brick) from the volume, the box must be inside the volume.
+	 */
+	VolumeView<const voxel> view(const aabbox &box) const {
+		assert(box.xmin <= box.xmax && box.ymin <= box.ymax && box.zmin <= box.zmax);
+		assert(box.xmin >= 0 && box.xmax <= this->width());
+		assert(box.ymin >= 0 && box.ymax <= this->height());
+		assert(box.zmin >= 0 && box.zmax <= this->depth());
+		VolumeView<const voxel> result;
+		result.slices = this->slices.data() + box.zmin;
+		result.offset = box.xmin + (size_t) this->sx * box.ymin;
+		result.strideY = this->sx;
+		result.sx = box.xmax - box.xmin;
+		result.sy = box.ymax - box.ymin;
+		result.sz = box.zmax - box.zmin;
+		return result;
+	}
+
+	VolumeView<voxel> view(const aabbox &box) {
+		this->detach(box.zmin, box.zmax);
+		VolumeView<const voxel> view = static_cast<const Volume *>(this)->view(box);
+		VolumeView<voxel> result;
+		result.slices = this->slices.data() + box.zmin;
+		result.offset = view.offset;
+		result.strideY = view.strideY;
+		result.sx = view.sx;
+		result.sy = view.sy;
+		result.sz = view.sz;
+		return result;
+	}
+
+	void fill(voxel value) {
+		const size_t sliceSize = (size_t) this->sx * this->sy;
+		this->detach(0, this->depth(), false);
+		for (unsigned z = 0; z < this->sz; ++z) {
+			voxel *slice = this->slices[z];
+			for (size_t i = 0; i < sliceSize; ++i) {
+				slice[i] = value;
+			}
 		}
-		if (static_cast<unsigned>(z) >= sz) {
+	}
+
+	/**
+	 * Fill the region connected to x, y, z having values similar to it, within the distance `max` from the seed.
+	 * The region is filled one row span at a time, only the first voxel of the neighbouring spans is pushed.
+	 */
+	void floodFill(int x, int y, int z, int max, float threshold, voxel fill) {
+		if (!this->contains(x, y, z)) {
 			return;
 		}
 		voxel current = this->get(x, y, z);
@@ -308,66 +651,95 @@ public:
 			return;
 		}
 
-		stack<tuple<int, int, int>> s;
-		s.push(make_tuple(x, y, z));
-
-		while (!s.empty()) {
-			x = std::get<0>(s.top());
-			y = std::get<1>(s.top());
-			z = std::get<2>(s.top());
-			s.pop();
+		const int sx = this->width();
+		const int sy = this->height();
+		const int sz = this->depth();
+		const int ox = x;
+		const int oy = y;
+		const int oz = z;
+		auto accept = [&](voxel value, int x, int y, int z) {
+			if (value.equals(fill, 0) || !value.equals(current, threshold)) {
+				return false;
+			}
+			int dx = x - ox;
+			int dy = y - oy;
+			int dz = z - oz;
+			return dx * dx + dy * dy + dz * dz < max * max;
+		};
+
+		struct Seed {
+			int x, y, z;
+		};
+		vector<Seed> seeds;
+		seeds.push_back(Seed {x, y, z});
+		bool first = true;
+		while (!seeds.empty()) {
+			Seed seed = seeds.back();
+			seeds.pop_back();
+
+			voxel *row = this->row(seed.y, seed.z);
+			if (!first && !accept(row[seed.x], seed.x, seed.y, seed.z)) {
+				// already filled from another span
+				continue;
+			}
+			first = false;
 
-			this->set(x, y, z, fill);
-			for (int i = 0; i < 6; i++) {
-				int nx = x + dx[i];
-				int ny = y + dy[i];
-				int nz = z + dz[i];
+			int x0 = seed.x;
+			while (x0 > 0 && accept(row[x0 - 1], x0 - 1, seed.y, seed.z)) {
+				x0 -= 1;
+			}
+			int x1 = seed.x + 1;
+			while (x1 < sx && accept(row[x1], x1, seed.y, seed.z)) {
+				x1 += 1;
+			}
+			for (int i = x0; i < x1; ++i) {
+				row[i] = fill;
+			}
 
-				if (static_cast<unsigned>(nx) >= sx) {
-					continue;
-				}
-				if (static_cast<unsigned>(ny) >= sy) {
-					continue;
-				}
-				if (static_cast<unsigned>(nz) >= sz) {
+			// push the first voxel of each span in the neighbouring rows touching the filled span
+			static const int dy[4] = {-1, 1, 0, 0};
+			static const int dz[4] = {0, 0, -1, 1};
+			for (int n = 0; n < 4; ++n) {
+				int ny = seed.y + dy[n];
+				int nz = seed.z + dz[n];
+				if (ny < 0 || ny >= sy || nz < 0 || nz >= sz) {
 					continue;
 				}
-				voxel next = this->get(nx, ny, nz);
-				if (next.equals(fill, 0)) {
-					continue;
-				}
-				if (!next.equals(current, threshold)) {
-					continue;
-				}
-				int dx = nx - ox;
-				int dy = ny - oy;
-				int dz = nz - oz;
-				if (dx * dx + dy * dy + dz * dz < max * max) {
-					s.push(make_tuple(nx, ny, nz));
+				const voxel *next = static_cast<const Volume *>(this)->row(ny, nz);
+				bool inside = false;
+				for (int i = x0; i < x1; ++i) {
+					bool accepted = accept(next[i], i, ny, nz);
+					if (accepted && !inside) {
+						seeds.push_back(Seed {i, ny, nz});
+					}
+					inside = accepted;
 				}
 			}
 		}
 	}
 
 	void forEach(const function<void(int x, int y, int z)> &action) const {
-		for (size_t pos = 0; pos < this->count; ++pos) {
-			size_t position = pos;
-			int x = static_cast<int>(position % this->sx);
-			position /= this->sx;
-			int y = static_cast<int>(position % this->sy);
-			position /= this->sy;
-			int z = static_cast<int>(position % this->sz);
-			action(x, y, z);
+		for (unsigned z = 0; z < this->sz; ++z) {
+			for (unsigned y = 0; y < this->sy; ++y) {
+				for (unsigned x = 0; x < this->sx; ++x) {
+					action(x, y, z);
+				}
+			}
 		}
 	}
 
-	void forEach(const function<void(voxel &value)> &action) const {
-		for (size_t pos = 0; pos < this->count; ++pos) {
-			action(this->voxels[pos]);
+	void forEach(const function<void(voxel &value)> &action) {
+		const size_t sliceSize = (size_t) this->sx * this->sy;
+		for (unsigned z = 0; z < this->sz; ++z) {
+			voxel *slice = this->slice(z);
+			for (size_t i = 0; i < sliceSize; ++i) {
+				action(slice[i]);
+			}
 		}
 	}
 
-	aabbox bounds(const function<bool(voxel value)> &accept) const {
+	template <class Accept>
+	aabbox bounds(const Accept &accept) const {
 		aabbox result;
 		result.xmin = 0;
 		result.xmax = 0;
@@ -376,11 +748,16 @@ public:
 		result.zmin = 0;
 		result.zmax = 0;
 
-		this->forEach([&result, &accept, this](int x, int y, int z) {
-			if (accept(this->voxels[this->position(x, y, z)])) {
-				result.includePoint(x, y, z);
+		for (unsigned z = 0; z < this->sz; ++z) {
+			for (unsigned y = 0; y < this->sy; ++y) {
+				const voxel *row = this->row(y, z);
+				for (unsigned x = 0; x < this->sx; ++x) {
+					if (accept(row[x])) {
+						result.includePoint(x, y, z);
+					}
+				}
 			}
-		});
+		}
 
 		result.xmax += 1;
 		result.ymax += 1;
@@ -399,104 +776,98 @@ public:
 		return result;
 	}
 
-	void resize(Volume<voxel> &dst, int linear) const {
-		if (linear == 0) {
-			unsigned dx = ((this->sx - 0) << 16) / dst.sx;
-			unsigned dy = ((this->sy - 0) << 16) / dst.sy;
-			unsigned dz = ((this->sz - 0) << 16) / dst.sz;
-			for (unsigned z = 0, sz = dz / 2; z < dst.sz; ++z, sz += dz) {
-				for (unsigned y = 0, sy = dz / 2; y < dst.sy; ++y, sy += dy) {
-					for (unsigned x = 0, sx = dx / 2; x < dst.sx; ++x, sx += dx) {
-						dst.set(x, y, z, this->get(sx >> 16, sy >> 16, sz >> 16));
-					}
+	/**
+	 * Resample this volume into dst, using a separable filter along each axis.
+	 * Each thread resamples the source slices in x and y into a small ring buffer,
+	 * which is then combined in z, so no full size intermediate volume is needed.
+	 */
+	void resize(Volume<voxel> &dst, ResizeFilter filter) const {
+		dst.detach(0, dst.depth(), false);
+		if (dst.sx == this->sx && dst.sy == this->sy && dst.sz == this->sz) {
+			parallelFor(0, this->sz, [this, &dst](int zmin, int zmax) {
+				for (int z = zmin; z < zmax; ++z) {
+					copy(this->slice(z), this->slice(z) + (size_t) this->sx * this->sy, dst.slice(z));
 				}
-			}
+			});
 			return;
 		}
 
-		unsigned dx = ((this->sx - 1) << 16) / dst.sx;
-		unsigned dy = ((this->sy - 1) << 16) / dst.sy;
-		unsigned dz = ((this->sz - 1) << 16) / dst.sz;
-		Volume<voxel> *mip = (Volume<voxel> *)this;
-		if (dx > 0x20000 || dy > 0x20000 || dz > 0x20000) {
-			mip = new Volume(*this);
-			while (dx > 0x20000) {
-				for (unsigned z = 0; z < mip->sz; ++z) {
-					for (unsigned y = 0; y < mip->sy; ++y) {
-						for (unsigned x = 0; x < mip->sx; ++x) {
-							voxel x0 = mip->get(x * 2 + 0, y, z);
-							voxel x1 = mip->get(x * 2 + 1, y, z);
-							x0.mix(x1, .5f);
-							mip->set(x, y, z, x0);
-						}
-					}
+		const ResizeWeights wx(this->sx, dst.sx, filter);
+		const ResizeWeights wy(this->sy, dst.sy, filter);
+		const ResizeWeights wz(this->sz, dst.sz, filter);
+		const size_t rowSize = dst.sx;
+		const size_t sliceSize = rowSize * dst.sy;
+
+		parallelFor(0, dst.sz, [&](int zmin, int zmax) {
+			// source rows resampled in x, and the ring of source slices resampled in x and y
+			vector<Sum> rows(rowSize * this->sy);
+			vector<Sum> ring(sliceSize * wz.taps);
+			vector<int> ringSlice(wz.taps, -1);
+			vector<Sum> out(sliceSize);
+
+			for (int z = zmin; z < zmax; ++z) {
+				const float *weightZ = &wz.weights[(size_t) z * wz.taps];
+				for (size_t i = 0; i < sliceSize; ++i) {
+					out[i] = Sum::zero;
 				}
-				dx >>= 1;
-			}
-			while (dy > 0x20000) {
-				for (unsigned z = 0; z < mip->sz; ++z) {
-					for (unsigned y = 0; y < mip->sy; ++y) {
-						for (unsigned x = 0; x < mip->sx; ++x) {
-							voxel y0 = mip->get(x, y * 2 + 0, z);
-							voxel y1 = mip->get(x, y * 2 + 1, z);
-							y0.mix(y1, .5f);
-							mip->set(x, y, z, y0);
-						}
+
+				for (int k = 0; k < wz.count[z]; ++k) {
+					const int srcZ = wz.first[z] + k;
+					Sum *slice = &ring[(srcZ % wz.taps) * sliceSize];
+					if (ringSlice[srcZ % wz.taps] != srcZ) {
+						ringSlice[srcZ % wz.taps] = srcZ;
+						resizeSlice(srcZ, wx, wy, rows.data(), slice, rowSize);
+					}
+					const float weight = weightZ[k];
+					if (weight == 0) {
+						continue;
 					}
+					for (size_t i = 0; i < sliceSize; ++i) {
+						out[i] += slice[i] * weight;
+					}
+				}
+
+				voxel *result = dst.slice(z);
+				for (size_t i = 0; i < sliceSize; ++i) {
+					result[i] = VoxelSum<voxel>::store(out[i]);
 				}
-				dy >>= 1;
 			}
-			while (dz > 0x20000) {
-				for (unsigned z = 0; z < mip->sz; ++z) {
-					for (unsigned y = 0; y < mip->sy; ++y) {
-						for (unsigned x = 0; x < mip->sx; ++x) {
-							voxel z0 = mip->get(x, y, z * 2 + 0);
-							voxel z1 = mip->get(x, y, z * 2 + 1);
-							z0.mix(z1, .5f);
-							mip->set(x, y, z, z0);
-						}
-					}
+		});
+	}
+
+private:
+	typedef typename VoxelSum<voxel>::type Sum;
+
+	// resample the slice z in x into rows, then in y into out
+	void resizeSlice(int z, const ResizeWeights &wx, const ResizeWeights &wy, Sum *rows, Sum *out, size_t rowSize) const {
+		for (unsigned y = 0; y < this->sy; ++y) {
+			const voxel *src = this->row(y, z);
+			Sum *dst = rows + y * rowSize;
+			for (size_t x = 0; x < rowSize; ++x) {
+				const float *weight = &wx.weights[x * wx.taps];
+				const voxel *from = src + wx.first[x];
+				Sum value = Sum::zero;
+				for (int k = 0; k < wx.count[x]; ++k) {
+					value += VoxelSum<voxel>::load(from[k]) * weight[k];
 				}
-				dz >>= 1;
+				dst[x] = value;
 			}
 		}
 
-		for (unsigned z = 0, sz = dz / 2; z < dst.sz; ++z, sz += dz) {
-			unsigned hz = sz >> 16;
-			float lz = (sz & 0xffff) / 65536.f;
-			for (unsigned y = 0, sy = dy / 2; y < dst.sy; ++y, sy += dy) {
-				unsigned hy = sy >> 16;
-				float ly = (sy & 0xffff) / 65536.f;
-				for (unsigned x = 0, sx = dx / 2; x < dst.sx; ++x, sx += dx) {
-					unsigned hx = sx >> 16;
-					float lx = (sx & 0xffff) / 65536.f;
-
-					voxel x0y0z0 = mip->get(hx + 0, hy + 0, hz + 0);
-					voxel x0y0z1 = mip->get(hx + 0, hy + 0, hz + 1);
-					voxel x0y1z0 = mip->get(hx + 0, hy + 1, hz + 0);
-					voxel x0y1z1 = mip->get(hx + 0, hy + 1, hz + 1);
-					voxel x1y0z0 = mip->get(hx + 0, hy + 0, hz + 0);
-					voxel x1y0z1 = mip->get(hx + 0, hy + 0, hz + 1);
-					voxel x1y1z0 = mip->get(hx + 0, hy + 1, hz + 0);
-					voxel x1y1z1 = mip->get(hx + 0, hy + 1, hz + 1);
-
-					x0y0z0.mix(x0y0z1, lz);
-					x0y1z0.mix(x0y1z1, lz);
-					x1y0z0.mix(x1y0z1, lz);
-					x1y1z0.mix(x1y1z1, lz);
-
-					x0y0z0.mix(x0y1z0, ly);
-					x1y0z0.mix(x1y1z0, ly);
-
-					x0y0z0.mix(x1y0z0, lx);
-
-					dst.set(x, y, z, x0y0z0);
+		for (size_t y = 0; y < wy.first.size(); ++y) {
+			const float *weight = &wy.weights[y * wy.taps];
+			Sum *dst = out + y * rowSize;
+			for (size_t x = 0; x < rowSize; ++x) {
+				dst[x] = Sum::zero;
+			}
+			for (int k = 0; k < wy.count[y]; ++k) {
+				const Sum *src = rows + (wy.first[y] + k) * rowSize;
+				const float w = weight[k];
+				for (size_t x = 0; x < rowSize; ++x) {
+					dst[x] += src[x] * w;
 				}
 			}
 		}
-		if (mip != this) {
-			delete mip;
-		}
 	}
 };
 
@@ -0,0 +1,290 @@
+#ifndef VOLUME_CACHE_H
+#define VOLUME_CACHE_H
+
+#include "volume.h"
+
+#include <QByteArray>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QThreadPool>
+
+#include <list>
+#include <unordered_map>
+
+/**
+ * Content addressed cache of volumes, the key is expected to be a hash of the content.
+ * The least recently used volumes are spilled to disk when the memory budget is exceeded,
+ * the oldest spilled files are removed when the disk budget is exceeded.
+ * The spilled files hold the raw voxels, so a volume loaded from disk is the same as the one spilled.
+ * The bricks shared by the cached volumes are counted once. The spills are written by a thread of the cache,
+ * when it falls behind by more than the memory budget the evicted volumes are dropped instead.
+ */
+template <class voxel> class VolumeCache {
+	struct Entry {
+		QByteArray key;
+		Volume<voxel> volume;
+	};
+
+	// header of the spilled files, followed by the voxels of the slices
+	struct SpillHeader {
+		uint32_t magic;
+		uint32_t voxelSize;
+		uint32_t width, height, depth;
+	};
+	enum : uint32_t { SpillMagic = 0x31435656 };	// "VVC1"
+
+	struct SpillTask : public QRunnable {
+		const function<void()> action;
+		explicit SpillTask(function<void()> action) : action(std::move(action)) {}
+		void run() override { action(); }
+	};
+
+	// the most recently used entry is the first
+	list<Entry> entries;
+	size_t memoryBudget;
+	size_t memoryUsed = 0;
+	qint64 diskBudget;
+	QString spillPath;
+
+	// number of the entries referencing each brick, the memory of a brick is counted once
+	unordered_map<const voxel *, unsigned> brickRefs;
+
+	// evicted volumes waiting to be written, they can still be found
+	QMutex pendingLock;
+	list<Entry> pending;
+	size_t pendingBytes = 0;
+
+	// declared last, so the running spills finish before the members they use are destroyed
+	QThreadPool spiller;
+
+public:
+	VolumeCache(size_t memoryBudget, qint64 diskBudget, const QString &spillPath)
+		: memoryBudget(memoryBudget), diskBudget(diskBudget), spillPath(spillPath) {
+		spiller.setMaxThreadCount(1);
+	}
+
+	~VolumeCache() {
+		spiller.waitForDone();
+	}
+
+	size_t memory() const { return memoryBudget; }
+	void memory(size_t value) {
+		memoryBudget = value;
+		trimMemory();
+	}
+
+	qint64 disk() const { return diskBudget; }
+	void disk(qint64 value) {
+		diskBudget = value;
+		trimDisk();
+	}
+
+	/**
+	 * Lookup a volume in memory, then on disk, the result shares the bricks with the cached volume.
+	 */
+	bool find(const QByteArray &key, Volume<voxel> &result) {
+		for (auto it = entries.begin(); it != entries.end(); ++it) {
+			if (it->key == key) {
+				entries.splice(entries.begin(), entries, it);
+				result.assign(it->volume);
+				return true;
+			}
+		}
+
+		{
+			QMutexLocker lock(&pendingLock);
+			for (const Entry &entry : pending) {
+				if (entry.key == key) {
+					result.assign(entry.volume);
+					lock.unlock();
+					insert(key, result);
+					return true;
+				}
+			}
+		}
+
+		QString path = spillFile(key);
+		if (!QFileInfo::exists(path)) {
+			return false;
+		}
+		if (!load(path, result)) {
+			// written by an older version or damaged, it is computed again
+			QFile::remove(path);
+			return false;
+		}
+		insert(key, result);
+		return true;
+	}
+
+	void insert(const QByteArray &key, const Volume<voxel> &volume) {
+		for (auto it = entries.begin(); it != entries.end(); ++it) {
+			if (it->key == key) {
+				release(it->volume);
+				entries.erase(it);
+				break;
+			}
+		}
+		entries.push_front(Entry {key, volume});
+		retain(volume);
+		trimMemory();
+	}
+
+	// drop the volumes kept in memory, spilled files are kept
+	void clear() {
+		entries.clear();
+		brickRefs.clear();
+		memoryUsed = 0;
+	}
+
+private:
+	static size_t sizeOf(const Volume<voxel> &volume) {
+		return (size_t) volume.width() * volume.height() * volume.depth() * sizeof(voxel);
+	}
+
+	static size_t brickSize(const Volume<voxel> &volume, unsigned brick) {
+		return (size_t) volume.width() * volume.height() * volume.brickDepth(brick) * sizeof(voxel);
+	}
+
+	// count the memory of the bricks not referenced by the other entries
+	void retain(const Volume<voxel> &volume) {
+		for (unsigned brick = 0; brick < volume.brickCount(); ++brick) {
+			if (brickRefs[volume.slice(volume.brickSlice(brick))]++ == 0) {
+				memoryUsed += brickSize(volume, brick);
+			}
+		}
+	}
+
+	void release(const Volume<voxel> &volume) {
+		for (unsigned brick = 0; brick < volume.brickCount(); ++brick) {
+			auto it = brickRefs.find(volume.slice(volume.brickSlice(brick)));
+			if (--it->second == 0) {
+				memoryUsed -= brickSize(volume, brick);
+				brickRefs.erase(it);
+			}
+		}
+	}
+
+	QString spillFile(const QByteArray &key) const {
+		return QDir(spillPath).filePath(QString::fromLatin1(key.toHex()) + ".vol");
+	}
+
+	// the file is written under a temporary name and renamed when complete
+	static bool spill(const QString &path, const Volume<voxel> &volume) {
+		QSaveFile file(path);
+		if (!file.open(QIODevice::WriteOnly)) {
+			return false;
+		}
+		const SpillHeader header = {SpillMagic, sizeof(voxel), (uint32_t) volume.width(), (uint32_t) volume.height(), (uint32_t) volume.depth()};
+		file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		for (unsigned brick = 0; brick < volume.brickCount(); ++brick) {
+			const voxel *data = volume.slice(volume.brickSlice(brick));
+			const qint64 bytes = (qint64) volume.width() * volume.height() * volume.brickDepth(brick) * sizeof(voxel);
+			if (file.write(reinterpret_cast<const char *>(data), bytes) != bytes) {
+				file.cancelWriting();
+				return false;
+			}
+		}
+		return file.commit();
+	}
+
+	// read the file into the result if it was spilled from a volume with the same dimensions
+	static bool load(const QString &path, Volume<voxel> &result) {
+		QFile file(path);
+		if (!file.open(QIODevice::ReadOnly)) {
+			return false;
+		}
+		SpillHeader header;
+		if (file.read(reinterpret_cast<char *>(&header), sizeof(header)) != sizeof(header)) {
+			return false;
+		}
+		if (header.magic != SpillMagic || header.voxelSize != sizeof(voxel)) {
+			return false;
+		}
+		if (header.width != (uint32_t) result.width() || header.height != (uint32_t) result.height() || header.depth != (uint32_t) result.depth()) {
+			return false;
+		}
+		if (file.size() != (qint64) (sizeof(header) + sizeOf(result))) {
+			return false;
+		}
+
+		// the result is replaced only when the whole file was read
+		Volume<voxel> volume = Volume<voxel>::uninitialized(header.width, header.height, header.depth);
+		for (unsigned brick = 0; brick < volume.brickCount(); ++brick) {
+			voxel *data = volume.slice(volume.brickSlice(brick));
+			const qint64 bytes = (qint64) volume.width() * volume.height() * volume.brickDepth(brick) * sizeof(voxel);
+			if (file.read(reinterpret_cast<char *>(data), bytes) != bytes) {
+				return false;
+			}
+		}
+		result.assign(volume);
+		return true;
+	}
+
+	void trimMemory() {
+		while (memoryUsed > memoryBudget && !entries.empty()) {
+			Entry &last = entries.back();
+			release(last.volume);
+			if (diskBudget > 0 && !QFileInfo::exists(spillFile(last.key))) {
+				schedule(std::move(last));
+			}
+			entries.pop_back();
+		}
+	}
+
+	// write the evicted volume in the background, the operations don't wait for the disk
+	void schedule(Entry &&entry) {
+		const QByteArray key = entry.key;
+		const size_t bytes = sizeOf(entry.volume);
+		{
+			QMutexLocker lock(&pendingLock);
+			for (const Entry &other : pending) {
+				if (other.key == key) {
+					return;
+				}
+			}
+			if (pendingBytes + bytes > memoryBudget) {
+				return;
+			}
+			pendingBytes += bytes;
+			pending.push_back(std::move(entry));
+		}
+		spiller.start(new SpillTask([this, key, bytes]() {
+			pendingLock.lock();
+			auto it = find_if(pending.begin(), pending.end(), [&key](const Entry &entry) {
+				return entry.key == key;
+			});
+			const Volume<voxel> volume = it->volume;
+			pendingLock.unlock();
+
+			if (QDir().mkpath(spillPath) && spill(spillFile(key), volume)) {
+				trimDisk();
+			}
+
+			QMutexLocker lock(&pendingLock);
+			pending.erase(find_if(pending.begin(), pending.end(), [&key](const Entry &entry) {
+				return entry.key == key;
+			}));
+			pendingBytes -= bytes;
+		}));
+	}
+
+	void trimDisk() {
+		QFileInfoList files = QDir(spillPath).entryInfoList(QStringList("*.vol"), QDir::Files, QDir::Time);
+		qint64 used = 0;
+		for (const QFileInfo &file : files) {
+			used += file.size();
+		}
+		// the files are sorted by modification time, the newest first
+		while (used > diskBudget && !files.empty()) {
+			used -= files.back().size();
+			QFile::remove(files.back().filePath());
+			files.pop_back();
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef VOLUME_DISTANCE_H
+#define VOLUME_DISTANCE_H
+
+#include "volume.h"
+#include "voxel_float1.h"
+
+#include <cfloat>
+
+/**
+ * Squared distance transform of a sampled function in linear time (Felzenszwalb and Huttenlocher).
+ * `v` must have room for n and `z` for n + 1 elements.
+ */
+static inline void distanceTransform(const float *f, float *d, int n, int *v, float *z) {
+	int k = 0;
+	v[0] = 0;
+	z[0] = -FLT_MAX;
+	z[1] = +FLT_MAX;
+	for (int q = 1; q < n; ++q) {
+		float s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+		while (s <= z[k]) {
+			k -= 1;
+			s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+		}
+		k += 1;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = +FLT_MAX;
+	}
+
+	k = 0;
+	for (int q = 0; q < n; ++q) {
+		while (z[k + 1] < q) {
+			k += 1;
+		}
+		d[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
+	}
+}
+
+/**
+ * Exact euclidean distance (in voxels) from each voxel to the nearest voxel accepted by `accept`.
+ * The transform is separable: it is computed along x, then y, then z, each axis in parallel.
+ * If none of the voxels is accepted the distances are larger than any distance inside the volume.
+ */
+template <class voxel, class Accept>
+void distanceTransform(const Volume<voxel> &volume, Volume<float1> &distance, const Accept &accept) {
+	assert(distance.width() == volume.width() && distance.height() == volume.height() && distance.depth() == volume.depth());
+	// larger than any squared distance, small enough to keep the precision of the parabola intersections
+	const float infinity = 4.f * ((float) volume.width() * volume.width() + (float) volume.height() * volume.height() + (float) volume.depth() * volume.depth());
+	const int width = volume.width();
+	const int height = volume.height();
+	const int depth = volume.depth();
+	const int length = max(width, max(height, depth));
+
+	// along x
+	distance.detach(0, depth, false);
+	parallelFor(0, depth, [&](int begin, int end) {
+		vector<float> f(length), d(length), z(length + 1);
+		vector<int> v(length);
+		for (int z0 = begin; z0 < end; ++z0) {
+			for (int y = 0; y < height; ++y) {
+				const voxel *row = volume.row(y, z0);
+				for (int x = 0; x < width; ++x) {
+					f[x] = accept(row[x]) ? 0 : infinity;
+				}
+				distanceTransform(f.data(), d.data(), width, v.data(), z.data());
+				float1 *out = distance.row(y, z0);
+				for (int x = 0; x < width; ++x) {
+					out[x].value = d[x];
+				}
+			}
+		}
+	});
+
+	// along y
+	parallelFor(0, depth, [&](int begin, int end) {
+		vector<float> f(length), d(length), z(length + 1);
+		vector<int> v(length);
+		for (int z0 = begin; z0 < end; ++z0) {
+			float1 *slice = distance.slice(z0);
+			for (int x = 0; x < width; ++x) {
+				for (int y = 0; y < height; ++y) {
+					f[y] = slice[x + (size_t) y * width].value;
+				}
+				distanceTransform(f.data(), d.data(), height, v.data(), z.data());
+				for (int y = 0; y < height; ++y) {
+					slice[x + (size_t) y * width].value = d[y];
+				}
+			}
+		}
+	});
+
+	// along z, taking the square root at the end; the columns are gathered reading whole rows
+	parallelFor(0, height, [&](int begin, int end) {
+		vector<float> columns((size_t) width * depth), d(length), z(length + 1);
+		vector<int> v(length);
+		for (int y = begin; y < end; ++y) {
+			for (int z0 = 0; z0 < depth; ++z0) {
+				const float1 *row = distance.row(y, z0);
+				for (int x = 0; x < width; ++x) {
+					columns[(size_t) x * depth + z0] = row[x].value;
+				}
+			}
+			for (int x = 0; x < width; ++x) {
+				float *f = &columns[(size_t) x * depth];
+				distanceTransform(f, d.data(), depth, v.data(), z.data());
+				for (int z0 = 0; z0 < depth; ++z0) {
+					f[z0] = sqrt(d[z0]);
+				}
+			}
+			for (int z0 = 0; z0 < depth; ++z0) {
+				float1 *row = distance.row(y, z0);
+				for (int x = 0; x < width; ++x) {
+					row[x].value = columns[(size_t) x * depth + z0];
+				}
+			}
+		}
+	});
+}
+
+/**
+ * Apply `action` on the voxels of the volume together with their distance.
+ */
+template <class voxel, class Action>
+void forEachDistance(Volume<voxel> &volume, const Volume<float1> &distance, const Action &action) {
+	const int width = volume.width();
+	const int height = volume.height();
+	volume.detach();
+	parallelFor(0, volume.depth(), [&](int begin, int end) {
+		for (int z = begin; z < end; ++z) {
+			for (int y = 0; y < height; ++y) {
+				const float1 *dist = distance.row(y, z);
+				voxel *row = volume.row(y, z);
+				for (int x = 0; x < width; ++x) {
+					action(row[x], dist[x].value);
+				}
+			}
+		}
+	});
+}
+
+/**
+ * Erode the foreground with a ball of the given radius: clear the foreground voxels within `radius` from the background.
+ */
+template <class voxel, class Accept>
+void erodeDistance(Volume<voxel> &volume, float radius, const Accept &foreground) {
+	Volume<float1> distance = Volume<float1>::uninitialized(volume.width(), volume.height(), volume.depth());
+	distanceTransform(volume, distance, [&foreground](const voxel &value) {
+		return !foreground(value);
+	});
+	forEachDistance(volume, distance, [radius](voxel &value, float dist) {
+		if (dist > 0 && dist <= radius) {
+			value = voxel::zero;
+		}
+	});
+}
+
+/**
+ * Dilate the foreground with a ball of the given radius: the background voxels within `radius` get the `fill` value.
+ */
+template <class voxel, class Accept>
+void dilateDistance(Volume<voxel> &volume, float radius, const Accept &foreground, voxel fill) {
+	Volume<float1> distance = Volume<float1>::uninitialized(volume.width(), volume.height(), volume.depth());
+	distanceTransform(volume, distance, foreground);
+	forEachDistance(volume, distance, [radius, &fill](voxel &value, float dist) {
+		if (dist > 0 && dist <= radius) {
+			value = fill;
+		}
+	});
+}
+
+/**
+ * Keep only the shell of the foreground: clear the foreground voxels farther than `radius` from the background.
+ */
+template <class voxel, class Accept>
+void shellDistance(Volume<voxel> &volume, float radius, const Accept &foreground) {
+	Volume<float1> distance = Volume<float1>::uninitialized(volume.width(), volume.height(), volume.depth());
+	distanceTransform(volume, distance, [&foreground](const voxel &value) {
+		return !foreground(value);
+	});
+	forEachDistance(volume, distance, [radius](voxel &value, float dist) {
+		if (dist > radius) {
+			value = voxel::zero;
+		}
+	});
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef VOLUME_EQUALIZE_H
+#define VOLUME_EQUALIZE_H
+
+#include "volume.h"
+#include "voxel_float1.h"
+
+/**
+ * Contrast limited adaptive histogram equalization in 3D.
+ * The volume is split into tiles of `windowSize` voxels, the clipped histogram of each tile is turned into a cdf,
+ * then each voxel is mapped by interpolating the cdfs of the 8 tiles with the nearest centers.
+ */
+static inline void equalizeHistogram(Volume<float1> &volume, int bins, int windowSize, float clipLimit) {
+	const int width = volume.width();
+	const int height = volume.height();
+	const int depth = volume.depth();
+	const int size = max(1, windowSize);
+	const int tx = (width + size - 1) / size;
+	const int ty = (height + size - 1) / size;
+	const int tz = (depth + size - 1) / size;
+
+	auto index = [bins](float value) {
+		int idx = bins * value;
+		return idx < 0 ? 0 : idx > bins ? bins : idx;
+	};
+
+	// clipped cdf of each tile
+	const Volume<float1> &src = volume;
+	vector<float> cdfs((size_t) tx * ty * tz * (bins + 1));
+	parallelFor(0, tx * ty * tz, [&](int begin, int end) {
+		vector<int> histogram(bins + 1);
+		for (int tile = begin; tile < end; ++tile) {
+			int x0 = tile % tx * size, x1 = min(width, x0 + size);
+			int y0 = tile / tx % ty * size, y1 = min(height, y0 + size);
+			int z0 = tile / tx / ty * size, z1 = min(depth, z0 + size);
+
+			fill(histogram.begin(), histogram.end(), 0);
+			for (int z = z0; z < z1; ++z) {
+				for (int y = y0; y < y1; ++y) {
+					const float1 *row = src.row(y, z);
+					for (int x = x0; x < x1; ++x) {
+						histogram[index(row[x].value)] += 1;
+					}
+				}
+			}
+
+			// crop off the top, then spread out the cropped area
+			int area = (x1 - x0) * (y1 - y0) * (z1 - z0);
+			int limit = clipLimit * area / bins;
+			float cropped = 0;
+			for (int l = 0; l < bins; ++l) {
+				int d = histogram[l] - limit;
+				if (d > 0) {
+					cropped += d;
+					histogram[l] = limit;
+				}
+			}
+			float spread = cropped / bins;
+
+			float *cdf = &cdfs[(size_t) tile * (bins + 1)];
+			float val = 0;
+			for (int l = 0; l <= bins; ++l) {
+				cdf[l] = val / area;
+				val += histogram[l] + spread;
+			}
+		}
+	});
+
+	// the tiles with the nearest centers and the interpolation weight along an axis
+	struct Neighbours {
+		int t0, t1;
+		float w;
+	};
+	auto neighbours = [size](int length, int tiles) {
+		vector<Neighbours> result(length);
+		for (int i = 0; i < length; ++i) {
+			float f = (i + .5f) / size - .5f;
+			int t0 = max(0, min(tiles - 1, (int) floor(f)));
+			int t1 = min(tiles - 1, t0 + 1);
+			float w = max(0.f, min(1.f, f - t0));
+			result[i] = Neighbours {t0, t1, t0 == t1 ? 0.f : w};
+		}
+		return result;
+	};
+	vector<Neighbours> nx = neighbours(width, tx);
+	vector<Neighbours> ny = neighbours(height, ty);
+	vector<Neighbours> nz = neighbours(depth, tz);
+
+	volume.detach();
+	parallelFor(0, depth, [&](int begin, int end) {
+		for (int z = begin; z < end; ++z) {
+			const Neighbours &cz = nz[z];
+			for (int y = 0; y < height; ++y) {
+				const Neighbours &cy = ny[y];
+				const float *c00 = &cdfs[((size_t) (cz.t0 * ty + cy.t0) * tx) * (bins + 1)];
+				const float *c01 = &cdfs[((size_t) (cz.t0 * ty + cy.t1) * tx) * (bins + 1)];
+				const float *c10 = &cdfs[((size_t) (cz.t1 * ty + cy.t0) * tx) * (bins + 1)];
+				const float *c11 = &cdfs[((size_t) (cz.t1 * ty + cy.t1) * tx) * (bins + 1)];
+				float1 *row = volume.row(y, z);
+				for (int x = 0; x < width; ++x) {
+					const Neighbours &cx = nx[x];
+					size_t i0 = (size_t) cx.t0 * (bins + 1) + index(row[x].value);
+					size_t i1 = (size_t) cx.t1 * (bins + 1) + index(row[x].value);
+					float v00 = c00[i0] + (c00[i1] - c00[i0]) * cx.w;
+					float v01 = c01[i0] + (c01[i1] - c01[i0]) * cx.w;
+					float v10 = c10[i0] + (c10[i1] - c10[i0]) * cx.w;
+					float v11 = c11[i0] + (c11[i1] - c11[i0]) * cx.w;
+					float v0 = v00 + (v01 - v00) * cy.w;
+					float v1 = v10 + (v11 - v10) * cy.w;
+					row[x] = float1(v0 + (v1 - v0) * cz.w);
+				}
+			}
+		}
+	});
+}
+
+#endif
@@ -2,9 +2,34 @@
 #define VOLUME_FILTER_H
 
 #include "volume.h"
+#include "volume_occupancy.h"
+
+/**
+ * Point-wise operation on a row of voxels, given with its position in the volume.
+ */
+template <class voxel> using RowOperation = function<void(voxel *row, int width, int y, int z)>;
+
+/**
+ * Apply the point-wise operation on each row of the volume, the slices are processed in parallel.
+ */
+template <class voxel>
+void forEachRow(Volume<voxel> &volume, const RowOperation<voxel> &operation) {
+	const int width = volume.width();
+	const int height = volume.height();
+	volume.detach();
+	parallelFor(0, volume.depth(), [&](int begin, int end) {
+		for (int z = begin; z < end; ++z) {
+			for (int y = 0; y < height; ++y) {
+				operation(volume.row(y, z), width, y, z);
+			}
+		}
+	});
+}
 
 #define dbgKernel(__MSG) do { cout << (__MSG) << endl; } while(false)
 template <class voxel> class Kernel: public Volume<voxel> {
+	typedef VolumeOccupancy<voxel> Occupancy;
+
 	struct Voxels {
 		voxel x, y, z;
 	};
@@ -238,67 +263,18 @@ public:
 		return *this;
 	}
 
-	void filter(const Volume<voxel> &volume, Volume<voxel> &output) {
-
+	/**
+	 * Filter the volume in place, the slices are streamed through a ring buffer as deep as the kernel,
+	 * so no other copy of the volume is made. `pre` is applied on the input rows as they are read,
+	 * `post` on the rows of the result, this way point-wise operations run in the same pass as the filter.
+	 */
+	void filter(Volume<voxel> &volume, const RowOperation<voxel> &pre = nullptr, const RowOperation<voxel> &post = nullptr) {
 		if (this->isSeparable(1e-6)) {
-			Volume<voxel> temp(output.width(), output.height(), output.depth());
-			aabbox bounds = volume.bounds([](voxel value) { return value != voxel::zero; });
-
-			// x direction: input -> output
-			for (int z = bounds.zmin; z < bounds.zmax; ++z) {
-				for (int y = bounds.ymin; y < bounds.ymax; ++y) {
-					for (int x = bounds.xmin; x < bounds.xmax; ++x) {
-						voxel value = voxel::zero;
-						for (unsigned i = 0; i < this->sx; ++i) {
-							int _x = x + i - this->cx;
-							if (_x < bounds.xmin || _x >= bounds.xmax) {
-								continue;
-							}
-							value += this->separable[i].x * volume.get(_x, y, z);
-						}
-						output.set(x, y, z, value);
-					}
-				}
-			}
-
-			// y direction: output -> temp
-			for (int z = bounds.zmin; z < bounds.zmax; ++z) {
-				for (int y = bounds.ymin; y < bounds.ymax; ++y) {
-					for (int x = bounds.xmin; x < bounds.xmax; ++x) {
-						voxel value = voxel::zero;
-						for (unsigned i = 0; i < this->sy; ++i) {
-							int _y = y + i - this->cy;
-							if (_y < bounds.ymin || _y >= bounds.ymax) {
-								continue;
-							}
-							value += this->separable[i].y * output.get(x, _y, z);
-						}
-						temp.set(x, y, z, value);
-					}
-				}
-			}
-
-			// z direction: temp -> output
-			for (int z = bounds.zmin; z < bounds.zmax; ++z) {
-				for (int y = bounds.ymin; y < bounds.ymax; ++y) {
-					for (int x = bounds.xmin; x < bounds.xmax; ++x) {
-						voxel value = voxel::zero;
-						for (unsigned i = 0; i < this->sz; ++i) {
-							int _z = z + i - this->cz;
-							if (_z < bounds.zmin || _z >= bounds.zmax) {
-								continue;
-							}
-							value += this->separable[i].z * temp.get(x, y, _z);
-						}
-						output.set(x, y, z, value);
-					}
-				}
-			}
-			return;
+			return convolve(volume, pre, post);
 		}
 
 		dbgKernel("filter.not.separable");
-		return filter(volume, output, [](size_t count, voxel values[]) {
+		return stream(volume, pre, post, [](size_t count, voxel values[]) {
 			voxel result = voxel::zero;
 			for (unsigned i = 0; i < count; i++) {
 				result += values[i];
@@ -307,25 +283,46 @@ public:
 		});
 	}
 
-	void erode(const Volume<voxel> &volume, Volume<voxel> &output) {
-		return filter(volume, output, [](size_t count, voxel values[]) {
+	void erode(Volume<voxel> &volume, const RowOperation<voxel> &pre = nullptr, const RowOperation<voxel> &post = nullptr) {
+		return stream(volume, pre, post, [](size_t count, voxel values[]) {
 			return *min_element(values, values + count);
 		});
 	}
 
-	void dilate(const Volume<voxel> &volume, Volume<voxel> &output) {
-		return filter(volume, output, [](size_t count, voxel values[]) {
+	void dilate(Volume<voxel> &volume, const RowOperation<voxel> &pre = nullptr, const RowOperation<voxel> &post = nullptr) {
+		return stream(volume, pre, post, [](size_t count, voxel values[]) {
 			return *max_element(values, values + count);
 		});
 	}
 
-	void median(const Volume<voxel> &volume, Volume<voxel> &output) {
-		return filter(volume, output, [](size_t count, voxel values[]) {
+	void median(Volume<voxel> &volume, const RowOperation<voxel> &pre = nullptr, const RowOperation<voxel> &post = nullptr) {
+		return stream(volume, pre, post, [](size_t count, voxel values[]) {
 			nth_element(values, values + count / 2, values + count);
 			return values[count / 2];
 		});
 	}
 
+	// the output shares the bricks of the volume until it is filtered in place
+	void filter(const Volume<voxel> &volume, Volume<voxel> &output) {
+		output.assign(volume);
+		filter(output);
+	}
+
+	void erode(const Volume<voxel> &volume, Volume<voxel> &output) {
+		output.assign(volume);
+		erode(output);
+	}
+
+	void dilate(const Volume<voxel> &volume, Volume<voxel> &output) {
+		output.assign(volume);
+		dilate(output);
+	}
+
+	void median(const Volume<voxel> &volume, Volume<voxel> &output) {
+		output.assign(volume);
+		median(output);
+	}
+
 private: // helper methods
 	inline bool isSeparable(float epsilon) {
 		if (this->separable == nullptr) {
@@ -353,44 +350,237 @@ private: // helper methods
 		}
 	}
 
-	void filter(const Volume<voxel> &volume, Volume<voxel> &output, const function<voxel(size_t count, voxel values[])> &action) {
-		// speed test: box filter (7x7x7)
-		// filter.lambda(time: 21.42 sec)
-		// filter.inline(time: 21.53 sec)
+	/**
+	 * Only the blocks around the occupied ones are filtered, the others are cleared.
+	 * When the input is changed by `pre` the volume can not be summarized in advance, all the blocks are filtered.
+	 */
+	Occupancy occupancy(const Volume<voxel> &volume, const RowOperation<voxel> &pre) const {
+		if (pre) {
+			return Occupancy(volume.width(), volume.height(), volume.depth());
+		}
+		TraceScope trace("filter.occupancy", (double) volume.width() * volume.height() * volume.depth());
+		return Occupancy(volume, [](voxel value) { return value != voxel::zero; });
+	}
 
-		voxel *values = new voxel[this->count];
-		aabbox bounds = volume.bounds([](voxel value) {
-			return value != voxel::zero;
-		});
-		for (int dz = bounds.zmin; dz <= bounds.zmax; ++dz) {
-			for (int dy = bounds.ymin; dy <= bounds.ymax; ++dy) {
-				for (int dx = bounds.xmin; dx <= bounds.xmax; ++dx) {
-					int offs = 0;
-					for (unsigned kz = 0; kz < this->sz; ++kz) {
-						int sz = dz + kz - this->cz;
-						if (sz < bounds.zmin || sz >= bounds.zmax) {
-							continue;
+	// the blocks of the output which may be non zero
+	vector<bool> activeBlocks(const Occupancy &occupancy) const {
+		return occupancy.active(
+			this->cx, this->sx - 1 - this->cx,
+			this->cy, this->sy - 1 - this->cy,
+			this->cz, this->sz - 1 - this->cz
+		);
+	}
+
+	// separable convolution: x and y are filtered into the ring, z from the ring back into the volume
+	void convolve(Volume<voxel> &volume, const RowOperation<voxel> &pre, const RowOperation<voxel> &post) {
+		const int width = volume.width();
+		const int height = volume.height();
+		const int depth = volume.depth();
+		const int ahead = this->sz - 1 - this->cz;
+		const size_t sliceSize = (size_t) width * height;
+
+		const Occupancy occupancy = this->occupancy(volume, pre);
+		const vector<bool> active = activeBlocks(occupancy);
+		const int blocksX = occupancy.blocksX();
+		auto isActive = [&](int i, int y, int z) {
+			return active[occupancy.index(i, y / Occupancy::BlockSize, z / Occupancy::BlockSlices)];
+		};
+
+		PoolBuffer<voxel> ring(sliceSize * this->sz);
+		PoolBuffer<voxel> temp(sliceSize);
+		volume.detach();
+
+		for (int z = 0; z < depth + ahead; ++z) {
+			if (z < depth) {
+				// x direction: volume -> temp
+				TraceScope trace("filter.x", sliceSize);
+				const voxel *slice = volume.slice(z);
+				parallelFor(0, height, [&](int begin, int end) {
+					vector<voxel> row(width);
+					for (int y = begin; y < end; ++y) {
+						const voxel *src = slice + (size_t) y * width;
+						if (pre) {
+							copy(src, src + width, row.begin());
+							pre(row.data(), width, y, z);
+							src = row.data();
 						}
-						for (unsigned ky = 0; ky < this->sy; ++ky) {
-							int sy = dy + ky - this->cy;
-							if (sy < bounds.ymin || sy >= bounds.ymax) {
+						voxel *dst = &temp[(size_t) y * width];
+						for (int i = 0; i < blocksX; ++i) {
+							const int xmin = i * Occupancy::BlockSize;
+							const int xmax = min(width, xmin + (int) Occupancy::BlockSize);
+							for (int x = xmin; x < xmax; ++x) {
+								dst[x] = voxel::zero;
+							}
+							if (!isActive(i, y, z)) {
+								continue;
+							}
+							for (unsigned k = 0; k < this->sx; ++k) {
+								const int offs = k - this->cx;
+								const voxel weight = this->separable[k].x;
+								const int begin = max(xmin, -offs);
+								const int end = min(xmax, width - offs);
+								for (int x = begin; x < end; ++x) {
+									dst[x] += weight * src[x + offs];
+								}
+							}
+						}
+					}
+				});
+			}
+			if (z < depth) {
+				// y direction: temp -> ring
+				TraceScope trace("filter.y", sliceSize);
+				voxel *filtered = &ring[(z % this->sz) * sliceSize];
+				parallelFor(0, height, [&](int begin, int end) {
+					for (int y = begin; y < end; ++y) {
+						voxel *dst = filtered + (size_t) y * width;
+						for (int i = 0; i < blocksX; ++i) {
+							const int xmin = i * Occupancy::BlockSize;
+							const int xmax = min(width, xmin + (int) Occupancy::BlockSize);
+							for (int x = xmin; x < xmax; ++x) {
+								dst[x] = voxel::zero;
+							}
+							if (!isActive(i, y, z)) {
 								continue;
 							}
-							for (unsigned kx = 0; kx < this->sx; ++kx) {
-								int sx = dx + kx - this->cx;
-								if (sx < bounds.xmin || sx >= bounds.xmax) {
+							for (unsigned k = 0; k < this->sy; ++k) {
+								int _y = y + k - this->cy;
+								if (_y < 0 || _y >= height || !isActive(i, _y, z)) {
 									continue;
 								}
-								values[offs] = this->get(kx, ky, kz) * volume.get(sx, sy, sz);
-								offs++;
+								const voxel weight = this->separable[k].y;
+								const voxel *src = &temp[(size_t) _y * width];
+								for (int x = xmin; x < xmax; ++x) {
+									dst[x] += weight * src[x];
+								}
 							}
 						}
 					}
-					output.set(dx, dy, dz, action(offs, values));
+				});
+			}
+
+			// z direction: ring -> volume, the input slice is not needed anymore
+			const int zo = z - ahead;
+			if (zo < 0) {
+				continue;
+			}
+			TraceScope trace("filter.z", sliceSize);
+			voxel *slice = volume.slice(zo);
+			parallelFor(0, height, [&](int begin, int end) {
+				for (int y = begin; y < end; ++y) {
+					voxel *dst = slice + (size_t) y * width;
+					for (int i = 0; i < blocksX; ++i) {
+						const int xmin = i * Occupancy::BlockSize;
+						const int xmax = min(width, xmin + (int) Occupancy::BlockSize);
+						for (int x = xmin; x < xmax; ++x) {
+							dst[x] = voxel::zero;
+						}
+						if (!isActive(i, y, zo)) {
+							continue;
+						}
+						for (unsigned k = 0; k < this->sz; ++k) {
+							int _z = zo + k - this->cz;
+							if (_z < 0 || _z >= depth || !isActive(i, y, _z)) {
+								continue;
+							}
+							const voxel weight = this->separable[k].z;
+							const voxel *src = &ring[(_z % this->sz) * sliceSize + (size_t) y * width];
+							for (int x = xmin; x < xmax; ++x) {
+								dst[x] += weight * src[x];
+							}
+						}
+					}
+					if (post) {
+						post(dst, width, y, zo);
+					}
 				}
+			});
+		}
+	}
+
+	// generic filter: the input slices are copied into the ring, the result is written back into the volume
+	void stream(Volume<voxel> &volume, const RowOperation<voxel> &pre, const RowOperation<voxel> &post, const function<voxel(size_t count, voxel values[])> &action) {
+		const int width = volume.width();
+		const int height = volume.height();
+		const int depth = volume.depth();
+		const int ahead = this->sz - 1 - this->cz;
+		const size_t sliceSize = (size_t) width * height;
+		const Volume<voxel> &kernel = *this;
+
+		const Occupancy occupancy = this->occupancy(volume, pre);
+		const vector<bool> active = activeBlocks(occupancy);
+		const int blocksX = occupancy.blocksX();
+
+		PoolBuffer<voxel> ring(sliceSize * this->sz);
+		volume.detach();
+
+		for (int z = 0; z < depth + ahead; ++z) {
+			if (z < depth) {
+				const voxel *slice = volume.slice(z);
+				voxel *input = &ring[(z % this->sz) * sliceSize];
+				copy(slice, slice + sliceSize, input);
+				if (pre) {
+					parallelFor(0, height, [&](int begin, int end) {
+						for (int y = begin; y < end; ++y) {
+							pre(input + (size_t) y * width, width, y, z);
+						}
+					});
+				}
+			}
+
+			const int zo = z - ahead;
+			if (zo < 0) {
+				continue;
 			}
+			TraceScope trace("filter.kernel", sliceSize);
+			voxel *slice = volume.slice(zo);
+			parallelFor(0, height, [&](int begin, int end) {
+				vector<voxel> values(this->count);
+				for (int dy = begin; dy < end; ++dy) {
+					voxel *dst = slice + (size_t) dy * width;
+					for (int i = 0; i < blocksX; ++i) {
+						const int xmin = i * Occupancy::BlockSize;
+						const int xmax = min(width, xmin + (int) Occupancy::BlockSize);
+						if (!active[occupancy.index(i, dy / Occupancy::BlockSize, zo / Occupancy::BlockSlices)]) {
+							for (int dx = xmin; dx < xmax; ++dx) {
+								dst[dx] = voxel::zero;
+							}
+							continue;
+						}
+
+						for (int dx = xmin; dx < xmax; ++dx) {
+							// the samples outside of the volume are skipped
+							const int kxmin = max(0, this->cx - dx);
+							const int kxmax = min((int) this->sx, width - dx + this->cx);
+							int offs = 0;
+							for (unsigned kz = 0; kz < this->sz; ++kz) {
+								int _z = zo + kz - this->cz;
+								if (_z < 0 || _z >= depth) {
+									continue;
+								}
+								const voxel *input = &ring[(_z % this->sz) * sliceSize];
+								for (unsigned ky = 0; ky < this->sy; ++ky) {
+									int _y = dy + ky - this->cy;
+									if (_y < 0 || _y >= height) {
+										continue;
+									}
+									const voxel *weights = kernel.row(ky, kz);
+									const voxel *src = input + (size_t) _y * width;
+									for (int kx = kxmin; kx < kxmax; ++kx) {
+										values[offs] = weights[kx] * src[dx + kx - this->cx];
+										offs++;
+									}
+								}
+							}
+							dst[dx] = action(offs, values.data());
+						}
+					}
+					if (post) {
+						post(dst, width, dy, zo);
+					}
+				}
+			});
 		}
-		delete[] values;
 	}
 
 	static double gauss(double x, double sigma, int dx) {
@@ -0,0 +1,181 @@
+#ifndef VOLUME_GRADIENT_H
+#define VOLUME_GRADIENT_H
+
+#include "volume.h"
+#include "volume_occupancy.h"
+#include "voxel_float1.h"
+
+/**
+ * Weights of the smoothing and the derivative filters of the gradient, from -radius to +radius.
+ * A sigma of 0 gives the Sobel operator, otherwise the derivative of a Gaussian is sampled up to 3 sigma.
+ * The smoothing sums to 1 and the derivative of a ramp with a slope of 1 is 1.
+ */
+struct GradientKernel {
+	int radius;
+	vector<float> smooth;
+	vector<float> derive;
+
+	explicit GradientKernel(float sigma) {
+		radius = sigma > 0 ? max(1, (int) ceil(3 * sigma)) : 1;
+		smooth.resize(2 * radius + 1);
+		derive.resize(2 * radius + 1);
+
+		double sum = 0, moment = 0;
+		for (int k = -radius; k <= radius; ++k) {
+			double weight = sigma > 0 ? exp(-.5 * k * k / (sigma * sigma)) : 2 - abs(k);
+			smooth[k + radius] = weight;
+			sum += weight;
+			moment += k * k * weight;
+		}
+		for (int k = -radius; k <= radius; ++k) {
+			derive[k + radius] = k * smooth[k + radius] / moment;
+			smooth[k + radius] /= sum;
+		}
+	}
+};
+
+/**
+ * Gradient of the volume in xyz, in values per voxel, and its magnitude in w.
+ * The components share the passes of the separable filters: along x the slices are smoothed and derived,
+ * along y these give the three partial products, along z the three components. This way each slice is read
+ * once and 8 one dimensional filters are applied instead of the 9 of three separate convolutions.
+ * The slices are streamed through a ring buffer as deep as the kernel, the samples outside of the volume
+ * repeat the border and the blocks far from the occupied voxels are cleared.
+ * The result voxels are constructed from the components and the magnitude, like float4 or normal4.
+ */
+template<class voxel>
+static inline void computeGradient(const Volume<float1> &volume, Volume<voxel> &result, float sigma = 0) {
+	typedef VolumeOccupancy<float1> Occupancy;
+	assert(result.width() == volume.width() && result.height() == volume.height() && result.depth() == volume.depth());
+	const int width = volume.width();
+	const int height = volume.height();
+	const int depth = volume.depth();
+	const size_t sliceSize = (size_t) width * height;
+	TraceScope trace("gradient", (double) sliceSize * depth);
+
+	const GradientKernel kernel(sigma);
+	const int radius = kernel.radius;
+	const int taps = 2 * radius + 1;
+	const float *smooth = kernel.smooth.data() + radius;
+	const float *derive = kernel.derive.data() + radius;
+
+	const Occupancy occupancy(volume, [](const float1 &value) { return value != float1::zero; });
+	const vector<bool> active = occupancy.active(radius, radius, radius, radius, radius, radius);
+	const int blocksX = occupancy.blocksX();
+	auto isActive = [&](int i, int y, int z) {
+		return active[occupancy.index(i, y / Occupancy::BlockSize, z / Occupancy::BlockSlices)];
+	};
+
+	// x: smoothed and derived, y: the three products of the slices in the ring
+	PoolBuffer<float> smoothX(sliceSize);
+	PoolBuffer<float> deriveX(sliceSize);
+	PoolBuffer<float> ring(3 * sliceSize * taps);
+	result.detach(0, depth, false);
+
+	for (int z = 0; z < depth + radius; ++z) {
+		if (z < depth) {
+			parallelFor(0, height, [&](int begin, int end) {
+				// the row with the border repeated, so the filter needs no bounds checks
+				vector<float> line(width + 2 * radius);
+				for (int y = begin; y < end; ++y) {
+					const float1 *src = volume.row(y, z);
+					for (int x = -radius; x < width + radius; ++x) {
+						line[x + radius] = src[min(max(x, 0), width - 1)].value;
+					}
+					float *s = &smoothX[(size_t) y * width];
+					float *d = &deriveX[(size_t) y * width];
+					for (int i = 0; i < blocksX; ++i) {
+						const int xmin = i * Occupancy::BlockSize;
+						const int xmax = min(width, xmin + (int) Occupancy::BlockSize);
+						for (int x = xmin; x < xmax; ++x) {
+							s[x] = d[x] = 0;
+						}
+						if (!isActive(i, y, z)) {
+							continue;
+						}
+						for (int k = -radius; k <= radius; ++k) {
+							const float *values = line.data() + radius + k;
+							for (int x = xmin; x < xmax; ++x) {
+								s[x] += smooth[k] * values[x];
+								d[x] += derive[k] * values[x];
+							}
+						}
+					}
+				}
+			});
+
+			float *ss = &ring[(z % taps) * 3 * sliceSize];
+			float *sd = ss + sliceSize;
+			float *ds = sd + sliceSize;
+			parallelFor(0, height, [&](int begin, int end) {
+				for (int y = begin; y < end; ++y) {
+					const size_t row = (size_t) y * width;
+					for (int i = 0; i < blocksX; ++i) {
+						const int xmin = i * Occupancy::BlockSize;
+						const int xmax = min(width, xmin + (int) Occupancy::BlockSize);
+						for (int x = xmin; x < xmax; ++x) {
+							ss[row + x] = sd[row + x] = ds[row + x] = 0;
+						}
+						if (!isActive(i, y, z)) {
+							continue;
+						}
+						for (int k = -radius; k <= radius; ++k) {
+							const size_t src = (size_t) min(max(y + k, 0), height - 1) * width;
+							const float *s = &smoothX[src];
+							const float *d = &deriveX[src];
+							for (int x = xmin; x < xmax; ++x) {
+								ss[row + x] += smooth[k] * s[x];
+								sd[row + x] += derive[k] * s[x];
+								ds[row + x] += smooth[k] * d[x];
+							}
+						}
+					}
+				}
+			});
+		}
+
+		// z: the components of the output slice, the ring holds the slices around it
+		const int zo = z - radius;
+		if (zo < 0) {
+			continue;
+		}
+		vector<const float *> slices(taps);
+		for (int k = -radius; k <= radius; ++k) {
+			slices[k + radius] = &ring[(min(max(zo + k, 0), depth - 1) % taps) * 3 * sliceSize];
+		}
+		voxel *slice = result.slice(zo);
+		parallelFor(0, height, [&](int begin, int end) {
+			float gx[Occupancy::BlockSize], gy[Occupancy::BlockSize], gz[Occupancy::BlockSize];
+			for (int y = begin; y < end; ++y) {
+				const size_t row = (size_t) y * width;
+				voxel *dst = slice + row;
+				for (int i = 0; i < blocksX; ++i) {
+					const int xmin = i * Occupancy::BlockSize;
+					const int count = min(width - xmin, (int) Occupancy::BlockSize);
+					if (!isActive(i, y, zo)) {
+						fill(dst + xmin, dst + xmin + count, voxel::zero);
+						continue;
+					}
+					fill(gx, gx + count, 0.f);
+					fill(gy, gy + count, 0.f);
+					fill(gz, gz + count, 0.f);
+					for (int k = -radius; k <= radius; ++k) {
+						const float *ss = slices[k + radius] + row + xmin;
+						const float *sd = ss + sliceSize;
+						const float *ds = sd + sliceSize;
+						for (int x = 0; x < count; ++x) {
+							gx[x] += smooth[k] * ds[x];
+							gy[x] += smooth[k] * sd[x];
+							gz[x] += derive[k] * ss[x];
+						}
+					}
+					for (int x = 0; x < count; ++x) {
+						dst[xmin + x] = voxel(gx[x], gy[x], gz[x], sqrt(gx[x] * gx[x] + gy[x] * gy[x] + gz[x] * gz[x]));
+					}
+				}
+			}
+		});
+	}
+}
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef VOLUME_HISTORY_H
+#define VOLUME_HISTORY_H
+
+#include "volume.h"
+
+#include <QByteArray>
+#include <QString>
+
+#include <deque>
+
+/**
+ * Undo and redo history of the operations applied to a volume.
+ * Each step keeps only the bricks changed by the operation, compressed.
+ * The oldest steps are dropped when the history exceeds the memory budget.
+ */
+template <class voxel> class VolumeHistory {
+	struct Brick {
+		unsigned index;
+		QByteArray data;
+	};
+
+	struct Step {
+		QString operation;
+		vector<Brick> bricks;
+		size_t size;
+	};
+
+	deque<Step> undos;
+	deque<Step> redos;
+	size_t budget;
+	size_t used = 0;
+
+public:
+	explicit VolumeHistory(size_t budget) : budget(budget) {}
+
+	size_t memoryBudget() const { return budget; }
+	void memoryBudget(size_t value) {
+		budget = value;
+		trim();
+	}
+
+	int undoCount() const { return undos.size(); }
+	int redoCount() const { return redos.size(); }
+
+	QString undoOperation() const { return undos.empty() ? QString() : undos.back().operation; }
+	QString redoOperation() const { return redos.empty() ? QString() : redos.back().operation; }
+
+	void clear() {
+		undos.clear();
+		redos.clear();
+		used = 0;
+	}
+
+	/**
+	 * Record an operation, storing the bricks of `before` which are not shared anymore with `after`.
+	 * `before` must be a copy of the volume made before the operation was executed.
+	 */
+	void record(const QString &operation, const Volume<voxel> &before, const Volume<voxel> &after) {
+		Step step = save(operation, before, [&before, &after](unsigned brick) {
+			return !after.sharesBrick(before, brick);
+		});
+		if (step.bricks.empty()) {
+			// nothing was changed
+			return;
+		}
+
+		for (const Step &redo : redos) {
+			used -= redo.size;
+		}
+		redos.clear();
+
+		used += step.size;
+		undos.push_back(std::move(step));
+		trim();
+	}
+
+	/**
+	 * Revert the last recorded operation, the current content of the bricks is kept for redo.
+	 */
+	bool undo(Volume<voxel> &volume) {
+		return swap(undos, redos, volume);
+	}
+
+	/**
+	 * Execute again the last reverted operation.
+	 */
+	bool redo(Volume<voxel> &volume) {
+		return swap(redos, undos, volume);
+	}
+
+private:
+	bool swap(deque<Step> &from, deque<Step> &to, Volume<voxel> &volume) {
+		if (from.empty()) {
+			return false;
+		}
+
+		Step step = std::move(from.back());
+		from.pop_back();
+		used -= step.size;
+
+		// save the current content of the bricks which are going to be overwritten
+		vector<bool> changed(volume.brickCount(), false);
+		for (const Brick &brick : step.bricks) {
+			changed[brick.index] = true;
+		}
+		Step current = save(step.operation, volume, [&changed](unsigned brick) {
+			return changed[brick];
+		});
+
+		// the restored bricks are overwritten, they don't need to be copied when shared
+		for (const Brick &brick : step.bricks) {
+			int z = volume.brickSlice(brick.index);
+			volume.detach(z, z + volume.brickDepth(brick.index), false);
+		}
+		parallelFor(0, step.bricks.size(), [&step, &volume](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				const Brick &brick = step.bricks[i];
+				int z = volume.brickSlice(brick.index);
+				size_t count = (size_t) volume.width() * volume.height() * volume.brickDepth(brick.index);
+				decompress(brick.data, volume.slice(z), count);
+			}
+		});
+
+		used += current.size;
+		to.push_back(std::move(current));
+		trim();
+		return true;
+	}
+
+	template <class Accept>
+	static Step save(const QString &operation, const Volume<voxel> &volume, const Accept &accept) {
+		Step result;
+		result.operation = operation;
+		result.size = 0;
+		for (unsigned brick = 0; brick < volume.brickCount(); ++brick) {
+			if (accept(brick)) {
+				result.bricks.push_back(Brick {brick, QByteArray()});
+			}
+		}
+
+		// compress the bricks in parallel
+		parallelFor(0, result.bricks.size(), [&result, &volume](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				Brick &brick = result.bricks[i];
+				const voxel *data = volume.slice(volume.brickSlice(brick.index));
+				size_t count = (size_t) volume.width() * volume.height() * volume.brickDepth(brick.index);
+				brick.data = compress(data, count);
+			}
+		});
+		for (const Brick &brick : result.bricks) {
+			result.size += brick.data.size();
+		}
+		return result;
+	}
+
+	// drop the oldest steps exceeding the memory budget
+	void trim() {
+		while (used > budget && !undos.empty()) {
+			used -= undos.front().size;
+			undos.pop_front();
+		}
+		while (used > budget && !redos.empty()) {
+			used -= redos.front().size;
+			redos.pop_front();
+		}
+	}
+
+	// group the bytes of the voxels by significance before compressing, similar values compress better
+	static QByteArray compress(const voxel *data, size_t count) {
+		const char *src = reinterpret_cast<const char *>(data);
+		QByteArray shuffled(static_cast<int>(count * sizeof(voxel)), Qt::Uninitialized);
+		char *dst = shuffled.data();
+		for (size_t b = 0; b < sizeof(voxel); ++b) {
+			for (size_t i = 0; i < count; ++i) {
+				dst[b * count + i] = src[i * sizeof(voxel) + b];
+			}
+		}
+		return qCompress(shuffled, 1);
+	}
+
+	static void decompress(const QByteArray &data, voxel *out, size_t count) {
+		QByteArray shuffled = qUncompress(data);
+		if ((size_t) shuffled.size() != count * sizeof(voxel)) {
+			throw runtime_error("Invalid history data");
+		}
+		const char *src = shuffled.constData();
+		char *dst = reinterpret_cast<char *>(out);
+		for (size_t b = 0; b < sizeof(voxel); ++b) {
+			for (size_t i = 0; i < count; ++i) {
+				dst[i * sizeof(voxel) + b] = src[b * count + i];
+			}
+		}
+	}
+};
+
+#endif
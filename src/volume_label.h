@@ -0,0 +1,239 @@
+#ifndef VOLUME_LABEL_H
+#define VOLUME_LABEL_H
+
+#include "volume.h"
+
+#include <climits>
+
+/**
+ * Size, bounding box and centroid of a connected component.
+ */
+struct VolumeComponent {
+	size_t count = 0;
+	int xmin = INT_MAX, ymin = INT_MAX, zmin = INT_MAX;
+	int xmax = INT_MIN, ymax = INT_MIN, zmax = INT_MIN;
+	double sumX = 0, sumY = 0, sumZ = 0;
+
+	void add(int x, int y, int z) {
+		count += 1;
+		xmin = min(xmin, x);
+		ymin = min(ymin, y);
+		zmin = min(zmin, z);
+		xmax = max(xmax, x);
+		ymax = max(ymax, y);
+		zmax = max(zmax, z);
+		sumX += x;
+		sumY += y;
+		sumZ += z;
+	}
+
+	void merge(const VolumeComponent &other) {
+		count += other.count;
+		xmin = min(xmin, other.xmin);
+		ymin = min(ymin, other.ymin);
+		zmin = min(zmin, other.zmin);
+		xmax = max(xmax, other.xmax);
+		ymax = max(ymax, other.ymax);
+		zmax = max(zmax, other.zmax);
+		sumX += other.sumX;
+		sumY += other.sumY;
+		sumZ += other.sumZ;
+	}
+
+	double centerX() const { return count > 0 ? sumX / count : 0; }
+	double centerY() const { return count > 0 ? sumY / count : 0; }
+	double centerZ() const { return count > 0 ? sumZ / count : 0; }
+};
+
+// find the root of the label, halving the path on the way
+static inline unsigned labelRoot(vector<unsigned> &parent, unsigned label) {
+	while (parent[label] != label) {
+		parent[label] = parent[parent[label]];
+		label = parent[label];
+	}
+	return label;
+}
+
+// the smaller root becomes the parent, so the roots do not depend on the order of the merges
+static inline void labelUnion(vector<unsigned> &parent, unsigned a, unsigned b) {
+	a = labelRoot(parent, a);
+	b = labelRoot(parent, b);
+	if (a < b) {
+		parent[b] = a;
+	}
+	else if (b < a) {
+		parent[a] = b;
+	}
+}
+
+/**
+ * Label the 6-connected components of the voxels accepted by `accept`, background voxels get the label 0.
+ * Each slab (brick) of the volume is labeled in parallel with a local union find,
+ * then the labels touching across the slab boundaries are merged, and renumbered in scan order in parallel.
+ * Returns the statistics of each component, the component with label `n` is at index `n - 1`.
+ */
+template <class voxel, class Accept>
+vector<VolumeComponent> labelComponents(const Volume<voxel> &volume, Volume<unsigned> &labels, const Accept &accept) {
+	assert(labels.width() == volume.width() && labels.height() == volume.height() && labels.depth() == volume.depth());
+	const int width = volume.width();
+	const int height = volume.height();
+	const int slabs = volume.brickCount();
+	const Volume<unsigned> &output = labels;
+	labels.detach(0, labels.depth(), false);
+
+	// provisional labels, local to each slab
+	vector<vector<unsigned>> parents(slabs);
+	parallelFor(0, slabs, [&](int begin, int end) {
+		for (int slab = begin; slab < end; ++slab) {
+			vector<unsigned> &parent = parents[slab];
+			parent.assign(1, 0);
+			const int z0 = volume.brickSlice(slab);
+			const int z1 = z0 + volume.brickDepth(slab);
+			for (int z = z0; z < z1; ++z) {
+				for (int y = 0; y < height; ++y) {
+					const voxel *row = volume.row(y, z);
+					const unsigned *up = y > 0 ? output.row(y - 1, z) : nullptr;
+					const unsigned *front = z > z0 ? output.row(y, z - 1) : nullptr;
+					unsigned *out = labels.row(y, z);
+					for (int x = 0; x < width; ++x) {
+						if (!accept(row[x])) {
+							out[x] = 0;
+							continue;
+						}
+						unsigned label = x > 0 ? out[x - 1] : 0;
+						if (up != nullptr && up[x] != 0) {
+							if (label != 0) {
+								labelUnion(parent, label, up[x]);
+							} else {
+								label = up[x];
+							}
+						}
+						if (front != nullptr && front[x] != 0) {
+							if (label != 0) {
+								labelUnion(parent, label, front[x]);
+							} else {
+								label = front[x];
+							}
+						}
+						if (label == 0) {
+							label = parent.size();
+							parent.push_back(label);
+						}
+						out[x] = label;
+					}
+				}
+			}
+		}
+	});
+
+	// the provisional labels of the slabs follow each other in the global union find
+	vector<unsigned> offsets(slabs + 1, 0);
+	for (int slab = 0; slab < slabs; ++slab) {
+		offsets[slab + 1] = offsets[slab] + parents[slab].size() - 1;
+	}
+	vector<unsigned> parent(offsets[slabs] + 1);
+	parent[0] = 0;
+	for (int slab = 0; slab < slabs; ++slab) {
+		for (unsigned label = 1; label < parents[slab].size(); ++label) {
+			parent[offsets[slab] + label] = offsets[slab] + labelRoot(parents[slab], label);
+		}
+	}
+
+	// merge the components touching between the last slice of a slab and the first of the next one
+	for (int slab = 1; slab < slabs; ++slab) {
+		const int z = volume.brickSlice(slab);
+		for (int y = 0; y < height; ++y) {
+			const unsigned *prev = output.row(y, z - 1);
+			const unsigned *next = output.row(y, z);
+			for (int x = 0; x < width; ++x) {
+				if (prev[x] != 0 && next[x] != 0) {
+					labelUnion(parent, offsets[slab - 1] + prev[x], offsets[slab] + next[x]);
+				}
+			}
+		}
+	}
+
+	// number the components in the order of their first voxel, the root is always the smallest label
+	vector<unsigned> compact(parent.size(), 0);
+	unsigned components = 0;
+	for (unsigned label = 1; label < parent.size(); ++label) {
+		unsigned root = labelRoot(parent, label);
+		if (root == label) {
+			components += 1;
+			compact[label] = components;
+		}
+		else {
+			compact[label] = compact[root];
+		}
+	}
+
+	// write the final labels, collecting the statistics of the provisional labels of each slab
+	vector<vector<VolumeComponent>> partial(slabs);
+	parallelFor(0, slabs, [&](int begin, int end) {
+		for (int slab = begin; slab < end; ++slab) {
+			vector<VolumeComponent> &stats = partial[slab];
+			stats.resize(parents[slab].size());
+			const int z0 = volume.brickSlice(slab);
+			const int z1 = z0 + volume.brickDepth(slab);
+			for (int z = z0; z < z1; ++z) {
+				for (int y = 0; y < height; ++y) {
+					unsigned *out = labels.row(y, z);
+					for (int x = 0; x < width; ++x) {
+						if (out[x] != 0) {
+							stats[out[x]].add(x, y, z);
+							out[x] = compact[offsets[slab] + out[x]];
+						}
+					}
+				}
+			}
+		}
+	});
+
+	vector<VolumeComponent> result(components);
+	for (int slab = 0; slab < slabs; ++slab) {
+		for (unsigned label = 1; label < partial[slab].size(); ++label) {
+			if (partial[slab][label].count > 0) {
+				result[compact[offsets[slab] + label] - 1].merge(partial[slab][label]);
+			}
+		}
+	}
+	return result;
+}
+
+/**
+ * Keep only the largest connected component of the voxels accepted by `accept`, everything else is cleared.
+ * Returns the number of components found.
+ */
+template <class voxel, class Accept>
+size_t keepLargestComponent(Volume<voxel> &volume, const Accept &accept) {
+	Volume<unsigned> labels = Volume<unsigned>::uninitialized(volume.width(), volume.height(), volume.depth());
+	vector<VolumeComponent> components = labelComponents(volume, labels, accept);
+
+	unsigned largest = 0;
+	for (unsigned i = 0; i < components.size(); ++i) {
+		if (largest == 0 || components[i].count > components[largest - 1].count) {
+			largest = i + 1;
+		}
+	}
+
+	const int width = volume.width();
+	const int height = volume.height();
+	const Volume<unsigned> &output = labels;
+	volume.detach();
+	parallelFor(0, volume.depth(), [&](int begin, int end) {
+		for (int z = begin; z < end; ++z) {
+			for (int y = 0; y < height; ++y) {
+				const unsigned *label = output.row(y, z);
+				voxel *row = volume.row(y, z);
+				for (int x = 0; x < width; ++x) {
+					if (label[x] != largest || largest == 0) {
+						row[x] = voxel::zero;
+					}
+				}
+			}
+		}
+	});
+	return components.size();
+}
+
+#endif
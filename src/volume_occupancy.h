@@ -0,0 +1,248 @@
+#ifndef VOLUME_OCCUPANCY_H
+#define VOLUME_OCCUPANCY_H
+
+#include "volume.h"
+
+/**
+ * Summary of the blocks of a volume: if the block has occupied voxels, and the range of the values in the block.
+ * Blocks are `BlockSize` voxels wide and high and `BlockSlices` deep, the ones at the edges may be smaller.
+ */
+template <class voxel> class VolumeOccupancy {
+public:
+	enum { BlockSize = 16, BlockSlices = 8 };
+
+	struct Block {
+		voxel min, max;
+		bool occupied;
+	};
+
+private:
+	int sx, sy, sz;
+	int bx, by, bz;
+	vector<Block> blocks;
+
+	// summarize the slabs of blocks from `kmin` to `kmax`, in parallel
+	template <class Accept>
+	void summarize(const Volume<voxel> &volume, int kmin, int kmax, const Accept &occupied) {
+		parallelFor(kmin, kmax, [&](int begin, int end) {
+			for (int k = begin; k < end; ++k) {
+				for (int j = 0; j < by; ++j) {
+					for (int i = 0; i < bx; ++i) {
+						Block &block = blocks[index(i, j, k)];
+						aabbox box = this->box(i, j, k);
+						block.occupied = false;
+						block.min = block.max = volume.row(box.ymin, box.zmin)[box.xmin];
+						for (int z = box.zmin; z < box.zmax; ++z) {
+							for (int y = box.ymin; y < box.ymax; ++y) {
+								const voxel *row = volume.row(y, z);
+								for (int x = box.xmin; x < box.xmax; ++x) {
+									const voxel &value = row[x];
+									if (value < block.min) {
+										block.min = value;
+									}
+									if (block.max < value) {
+										block.max = value;
+									}
+									if (!block.occupied && occupied(value)) {
+										block.occupied = true;
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+		});
+	}
+
+	/**
+	 * Visit the cells of a grid crossed by the ray `from + dir * t`, for t from `t0` to `t1`, in their order
+	 * along the ray, until `visit(cell, enter, exit)` returns true. The cells are `size` wide along each axis.
+	 */
+	template <class Visit>
+	static bool traverse(const float from[3], const float dir[3], float t0, float t1, const int size[3], const int cells[3], const Visit &visit) {
+		int cell[3], step[3];
+		float next[3], delta[3];
+		for (int a = 0; a < 3; ++a) {
+			int index = (int) floor((from[a] + dir[a] * t0) / size[a]);
+			cell[a] = min(max(index, 0), cells[a] - 1);
+			if (dir[a] > 0) {
+				step[a] = 1;
+				next[a] = ((cell[a] + 1) * size[a] - from[a]) / dir[a];
+				delta[a] = size[a] / dir[a];
+			}
+			else if (dir[a] < 0) {
+				step[a] = -1;
+				next[a] = (cell[a] * size[a] - from[a]) / dir[a];
+				delta[a] = -size[a] / dir[a];
+			}
+			else {
+				step[a] = 0;
+				next[a] = delta[a] = INFINITY;
+			}
+		}
+
+		for (float enter = t0; enter < t1;) {
+			const int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+			const float exit = min(next[a], t1);
+			if (visit((const int *) cell, enter, exit)) {
+				return true;
+			}
+			cell[a] += step[a];
+			if (cell[a] < 0 || cell[a] >= cells[a]) {
+				break;
+			}
+			next[a] += delta[a];
+			enter = exit;
+		}
+		return false;
+	}
+
+public:
+	/**
+	 * Summarize the volume, the slabs of blocks are computed in parallel.
+	 */
+	template <class Accept>
+	VolumeOccupancy(const Volume<voxel> &volume, const Accept &occupied)
+		: sx(volume.width()), sy(volume.height()), sz(volume.depth())
+		, bx((sx + BlockSize - 1) / BlockSize)
+		, by((sy + BlockSize - 1) / BlockSize)
+		, bz((sz + BlockSlices - 1) / BlockSlices)
+		, blocks((size_t) bx * by * bz) {
+		summarize(volume, 0, bz, occupied);
+	}
+
+	/**
+	 * Summarize again the blocks covering the slices from `zmin` to `zmax` of the volume, which has the same size.
+	 */
+	template <class Accept>
+	void update(const Volume<voxel> &volume, int zmin, int zmax, const Accept &occupied) {
+		summarize(volume, zmin / BlockSlices, min(bz, (zmax + BlockSlices - 1) / BlockSlices), occupied);
+	}
+
+	/**
+	 * Summary of a volume of the given size with all the blocks occupied, the range of the values is not known.
+	 */
+	VolumeOccupancy(int width, int height, int depth)
+		: sx(width), sy(height), sz(depth)
+		, bx((sx + BlockSize - 1) / BlockSize)
+		, by((sy + BlockSize - 1) / BlockSize)
+		, bz((sz + BlockSlices - 1) / BlockSlices)
+		, blocks((size_t) bx * by * bz, Block {voxel::zero, voxel::zero, true}) {
+	}
+
+	inline int blocksX() const { return bx; }
+	inline int blocksY() const { return by; }
+	inline int blocksZ() const { return bz; }
+
+	inline size_t index(int i, int j, int k) const {
+		return i + (size_t) bx * (j + (size_t) by * k);
+	}
+
+	inline const Block &block(int i, int j, int k) const {
+		return blocks[index(i, j, k)];
+	}
+
+	// the voxels covered by the block
+	aabbox box(int i, int j, int k) const {
+		aabbox result;
+		result.xmin = i * BlockSize;
+		result.ymin = j * BlockSize;
+		result.zmin = k * BlockSlices;
+		result.xmax = min(sx, result.xmin + (int) BlockSize);
+		result.ymax = min(sy, result.ymin + (int) BlockSize);
+		result.zmax = min(sz, result.zmin + (int) BlockSlices);
+		return result;
+	}
+
+	/**
+	 * Walk the ray from `from` to `to`, in voxel units, to the first voxel accepted and set `hit` to the point
+	 * where the ray enters it. The blocks whose maximum is not accepted are skipped, so `accept` must also
+	 * accept all the values above an accepted one, like a threshold.
+	 */
+	template <class Accept>
+	bool raycast(const Volume<voxel> &volume, const float from[3], const float to[3], const Accept &accept, float hit[3]) const {
+		const int size[3] = {sx, sy, sz};
+		float dir[3];
+		float t0 = 0, t1 = 1;
+		for (int a = 0; a < 3; ++a) {
+			dir[a] = to[a] - from[a];
+			if (dir[a] == 0) {
+				if (from[a] < 0 || from[a] > size[a]) {
+					return false;
+				}
+				continue;
+			}
+			// clip the ray to the volume
+			float ta = -from[a] / dir[a];
+			float tb = (size[a] - from[a]) / dir[a];
+			t0 = max(t0, min(ta, tb));
+			t1 = min(t1, max(ta, tb));
+		}
+		if (t0 >= t1) {
+			return false;
+		}
+
+		const int blockSize[3] = {BlockSize, BlockSize, BlockSlices};
+		const int blockCount[3] = {bx, by, bz};
+		const int voxelSize[3] = {1, 1, 1};
+		return traverse(from, dir, t0, t1, blockSize, blockCount, [&](const int *block, float enter, float exit) {
+			if (!accept(this->block(block[0], block[1], block[2]).max)) {
+				return false;
+			}
+			return traverse(from, dir, enter, exit, voxelSize, size, [&](const int *cell, float enter, float) {
+				if (!accept(volume.row(cell[1], cell[2])[cell[0]])) {
+					return false;
+				}
+				for (int a = 0; a < 3; ++a) {
+					hit[a] = from[a] + dir[a] * enter;
+				}
+				return true;
+			});
+		});
+	}
+
+	// fraction of the blocks with occupied voxels
+	float occupied() const {
+		size_t count = 0;
+		for (const Block &block : blocks) {
+			count += block.occupied;
+		}
+		return blocks.empty() ? 0 : (float) count / blocks.size();
+	}
+
+	/**
+	 * Blocks which may be affected by the occupied ones, when each voxel depends on the voxels
+	 * from `-lo` to `+hi` around it along each axis, like the output of a filter.
+	 */
+	vector<bool> active(int xlo, int xhi, int ylo, int yhi, int zlo, int zhi) const {
+		vector<bool> result(blocks.size(), false);
+		for (int k = 0; k < bz; ++k) {
+			for (int j = 0; j < by; ++j) {
+				for (int i = 0; i < bx; ++i) {
+					if (!block(i, j, k).occupied) {
+						continue;
+					}
+					// mark the blocks containing the voxels depending on this block
+					aabbox box = this->box(i, j, k);
+					int i0 = max(0, (box.xmin - xhi) / (int) BlockSize);
+					int i1 = min(bx - 1, (box.xmax - 1 + xlo) / (int) BlockSize);
+					int j0 = max(0, (box.ymin - yhi) / (int) BlockSize);
+					int j1 = min(by - 1, (box.ymax - 1 + ylo) / (int) BlockSize);
+					int k0 = max(0, (box.zmin - zhi) / (int) BlockSlices);
+					int k1 = min(bz - 1, (box.zmax - 1 + zlo) / (int) BlockSlices);
+					for (int kk = k0; kk <= k1; ++kk) {
+						for (int jj = j0; jj <= j1; ++jj) {
+							for (int ii = i0; ii <= i1; ++ii) {
+								result[index(ii, jj, kk)] = true;
+							}
+						}
+					}
+				}
+			}
+		}
+		return result;
+	}
+};
+
+#endif
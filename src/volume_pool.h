@@ -0,0 +1,190 @@
+#ifndef VOLUME_POOL_H
+#define VOLUME_POOL_H
+
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+/**
+ * Pool of uninitialized, aligned buffers for the bricks of the volumes and the temporaries of the operations.
+ * The sizes are rounded up to size classes, the released buffers are kept for reuse up to the budget,
+ * so repeating an operation does not pay again for the page faults and the zero filling of the memory.
+ */
+class VolumePool {
+public:
+	enum : size_t {
+		Alignment = 64,
+		HugePage = 2 << 20
+	};
+
+private:
+	mutex lock;
+	map<size_t, vector<void *>> buffers;
+	size_t budget;
+	size_t retained = 0;
+
+	// bytes of the buffers given out, and their maximum since the last reset
+	atomic<size_t> inUse;
+	atomic<size_t> maxInUse;
+
+	void acquired(size_t size) {
+		size_t value = inUse += size;
+		size_t peak = maxInUse.load();
+		while (value > peak && !maxInUse.compare_exchange_weak(peak, value)) {
+		}
+	}
+
+	// powers of two up to a huge page, multiples of huge pages above
+	static size_t sizeClass(size_t size) {
+		if (size >= HugePage) {
+			return (size + HugePage - 1) / HugePage * HugePage;
+		}
+		size_t result = Alignment;
+		while (result < size) {
+			result *= 2;
+		}
+		return result;
+	}
+
+	static void *allocateAligned(size_t size) {
+		const size_t alignment = size >= HugePage ? HugePage : Alignment;
+		void *result = nullptr;
+#ifdef _WIN32
+		result = _aligned_malloc(size, alignment);
+#else
+		if (posix_memalign(&result, alignment, size) != 0) {
+			result = nullptr;
+		}
+#endif
+		if (result == nullptr) {
+			throw bad_alloc();
+		}
+#ifdef MADV_HUGEPAGE
+		if (size >= HugePage) {
+			madvise(result, size, MADV_HUGEPAGE);
+		}
+#endif
+		return result;
+	}
+
+	static void freeAligned(void *data) {
+#ifdef _WIN32
+		_aligned_free(data);
+#else
+		std::free(data);
+#endif
+	}
+
+public:
+	explicit VolumePool(size_t budget) : budget(budget), inUse(0), maxInUse(0) {}
+
+	~VolumePool() {
+		trim();
+	}
+
+	// the pool shared by the volumes
+	static VolumePool &instance() {
+		static VolumePool pool(1024 << 20);
+		return pool;
+	}
+
+	/**
+	 * Get a buffer of at least `size` bytes, the content is not initialized.
+	 */
+	void *allocate(size_t size) {
+		size = sizeClass(size);
+		acquired(size);
+		{
+			lock_guard<mutex> locker(lock);
+			auto it = buffers.find(size);
+			if (it != buffers.end() && !it->second.empty()) {
+				void *result = it->second.back();
+				it->second.pop_back();
+				retained -= size;
+				return result;
+			}
+		}
+		try {
+			return allocateAligned(size);
+		} catch (...) {
+			inUse -= size;
+			throw;
+		}
+	}
+
+	/**
+	 * Give back a buffer allocated with the same size, it is freed if the pool is full.
+	 */
+	void release(void *data, size_t size) {
+		if (data == nullptr) {
+			return;
+		}
+		size = sizeClass(size);
+		inUse -= size;
+		{
+			lock_guard<mutex> locker(lock);
+			if (retained + size <= budget) {
+				buffers[size].push_back(data);
+				retained += size;
+				return;
+			}
+		}
+		freeAligned(data);
+	}
+
+	// bytes of the buffers in use, rounded up to their size classes
+	size_t used() const { return inUse; }
+
+	// maximum of the bytes in use since the last reset
+	size_t peak() const { return maxInUse; }
+	void resetPeak() { maxInUse = inUse.load(); }
+
+	// free the kept buffers until at most `keep` bytes are retained
+	void trim(size_t keep = 0) {
+		lock_guard<mutex> locker(lock);
+		for (auto it = buffers.begin(); it != buffers.end() && retained > keep; ++it) {
+			while (!it->second.empty() && retained > keep) {
+				freeAligned(it->second.back());
+				it->second.pop_back();
+				retained -= it->first;
+			}
+		}
+	}
+};
+
+/**
+ * Uninitialized array of trivial values taken from the pool, given back when destroyed.
+ */
+template <class T> class PoolBuffer {
+	T *values;
+	size_t length;
+
+public:
+	explicit PoolBuffer(size_t length)
+		: values((T *) VolumePool::instance().allocate(length * sizeof(T))), length(length) {}
+
+	PoolBuffer(const PoolBuffer &) = delete;
+	PoolBuffer &operator=(const PoolBuffer &) = delete;
+
+	~PoolBuffer() {
+		VolumePool::instance().release(values, length * sizeof(T));
+	}
+
+	inline T *data() { return values; }
+	inline const T *data() const { return values; }
+	inline size_t size() const { return length; }
+
+	inline T &operator[](size_t index) { return values[index]; }
+	inline const T &operator[](size_t index) const { return values[index]; }
+};
+
+#endif
@@ -1,21 +1,41 @@
 #include "volume_quick.h"
 #include "volume_filter.h"
+#include "volume_label.h"
+#include "volume_distance.h"
+#include "volume_equalize.h"
+#include "volume_stats.h"
+#include "volume_gradient.h"
 
 #include <QRunnable>
 #include <QCollator>
 #include <QDirIterator>
+#include <QFile>
 #include <QFileInfo>
+#include <QCryptographicHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QUuid>
 #include <utility>
 
+// cancel flag of the task running on the calling thread
+static thread_local atomic<bool> *currentCancel = nullptr;
+
 struct Task : public QRunnable {
 
 	VolumeExecutor &runner;
 	const QString operation;
 	const function<void()> action;
+	const shared_ptr<atomic<bool>> cancel;
 
 	Task(VolumeExecutor &runner, QString operation, function<void()> action)
-		: runner(runner), operation(std::move(operation)), action(std::move(action)) {
+		: runner(runner), operation(std::move(operation)), action(std::move(action)), cancel(make_shared<atomic<bool>>(false)) {
 		this->setAutoDelete(true);
+		QMutexLocker lock(&runner.cancelLock);
+		auto &flags = runner.cancelFlags;
+		flags.erase(remove_if(flags.begin(), flags.end(), [](const weak_ptr<atomic<bool>> &flag) {
+			return flag.expired();
+		}), flags.end());
+		flags.push_back(cancel);
 	}
 
 public:
@@ -23,7 +43,12 @@ public:
 		QElapsedTimer timer;
 		try {
 			timer.start();
+			// the peak is tracked for the operation, the executor runs one at a time by default
+			VolumePool::instance().resetPeak();
+			currentCancel = cancel.get();
+			TraceScope trace(operation.isEmpty() ? "task" : qPrintable(operation));
 			action();
+			trace.peakMemory(VolumePool::instance().peak());
 			emit runner.operationComplete(runner.time(), timer.elapsed(), operation);
 		} catch (const std::overflow_error& e) {
 			// this executes if f() throws std::overflow_error (same type rule)
@@ -42,10 +67,24 @@ public:
 			cerr << "error: unknown" << endl;
 			emit runner.operationFailed(runner.time(), operation);
 		}
+		currentCancel = nullptr;
 	}
 };
 
+bool VolumeExecutor::cancelled() {
+	return currentCancel != nullptr && *currentCancel;
+}
 void VolumeExecutor::start(const QString &operation, const function<void()> &action) {
+	{
+		// the queued tasks are dropped, the running ones may stop early
+		QMutexLocker lock(&cancelLock);
+		for (const weak_ptr<atomic<bool>> &flag : cancelFlags) {
+			if (shared_ptr<atomic<bool>> cancel = flag.lock()) {
+				*cancel = true;
+			}
+		}
+		cancelFlags.clear();
+	}
 	executor.clear();
 	executor.start(new Task(*this, operation, action));
 }
@@ -65,31 +104,6 @@ static bool ends_with(const string& str, const string& end) {
 	return true;
 }
 
-static const float inf = 1e30f;
-
-static void normalize(Volume<float1> &volume, bool useAbs = false) {
-	float1 min(+inf);
-	float1 max(-inf);
-	volume.forEach([&min, &max](float1 &value) {
-		if (min.value > value.value) {
-			min.value = value.value;
-		}
-		if (max.value < value.value) {
-			max.value = value.value;
-		}
-	});
-
-	if (useAbs) {
-		volume.forEach([&min, &max](float1 &value) {
-			value.value = abs(value.value / (max.value - min.value));
-		});
-	} else {
-		volume.forEach([&min, &max](float1 &value) {
-			value.value = (value.value - min.value) / (max.value - min.value);
-		});
-	}
-}
-
 void VolumeData::readSlices(const string &path, int width, int height, unsigned blurSize, int slices, const function<void(const string &path, Volume<float1> &volume, int z)> &readSlice) {
 	Volume<float1> *resize = &input;
 
@@ -109,6 +123,17 @@ void VolumeData::readSlices(const string &path, int width, int height, unsigned
 		return collator.compare(a, b) < 0;
 	});
 
+	// the cached results depend on every slice of the stack, not only on the opened file
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+	hash.addData(inputKey);
+	for (const QString &name : files) {
+		QFileInfo info(name);
+		hash.addData(info.absoluteFilePath().toUtf8());
+		hash.addData(QByteArray::number(info.size()));
+		hash.addData(QByteArray::number(info.lastModified().toMSecsSinceEpoch()));
+	}
+	inputKey = hash.result();
+
 	if (slices > 0) {
 		if (slices < files.size()) {
 			slices = files.size();
@@ -125,38 +150,84 @@ void VolumeData::readSlices(const string &path, int width, int height, unsigned
 	input.fill(float1::zero);
 	for (unsigned z = 0; z < files.size(); z++) {
 		//log() << "reading slice[" << z << " / " << resize->depth() << "]: " << files[z].toStdString();
+		TraceScope trace("decode", (double) resize->width() * resize->height());
 		readSlice(files[z].toStdString(), *resize, z + spacing);
 	}
 	log() << "images loaded: " << files.size();
 
-	normalize(*resize);
-	log() << "volume normalized: [" << 2 << ", " << 3 << "]";
+	VolumeStats stats;
+	{
+		TraceScope trace("normalize", (double) resize->width() * resize->height() * resize->depth());
+		stats = normalize(*resize);
+	}
+	log() << "volume normalized: [" << stats.min << ", " << stats.max << "]";
 
 	if (blurSize > 1) {
-		Volume<float1> *blured = new Volume<float1>(resize->width(), resize->height(), resize->depth());
-		Kernel<float1>(blurSize).fillGauss(blurSize / 4.).filter(*resize, *blured);
+		Volume<float1> *blured = new Volume<float1>(*resize);
+		Kernel<float1>(blurSize).fillGauss(blurSize / 4.).filter(*blured);
 		delete resize;
 		resize = blured;
 		log() << "volume blured";
 	}
 
 	if (resize != &input) {
-		resize->resize(input, 1);
+		TraceScope trace("resize", (double) input.width() * input.height() * input.depth());
+		resize->resize(input, ResizeLinear);
 		delete resize;
 		log() << "volume resized";
 	}
 }
+void VolumeData::publish() {
+	QMutexLocker lock(&viewLock);
+	inputView.assign(input);
+	savedView.assign(saved);
+}
 void VolumeData::onInputChanged() {
+	publish();
+	{
+		// updated by the task, so the gui thread only reads the cached statistics
+		TraceScope trace("statistics");
+		QMutexLocker lock(&statsLock);
+		inputStats.update(input);
+	}
 	thumbDirty = true;
 	emit volumeChanged();
 }
+QByteArray VolumeData::uniqueKey() {
+	return QUuid::createUuid().toRfc4122();
+}
+void VolumeData::modify(const QString &operation, const function<void()> &action) {
+	this->push(operation, [this, operation, action]() {
+		// the copy shares the bricks with the input, only the modified ones will be recorded
+		Volume<float1> before = input;
+		action();
+		history.record(operation, before, input);
+		inputKey = uniqueKey();
+		onInputChanged();
+	});
+}
 
 void VolumeData::open(const QUrl &qPath, int slices) {
 	string path = qPath.toLocalFile().toStdString();
 	log() << "open(file: " << path << ", slices: " << slices << ")";
 	this->start("open", [this, path, slices]() {
+		history.clear();
+		// the buffers kept for the previous volume probably have other sizes
+		VolumePool::instance().trim();
+
+		// reopening the same file gives the same key, so the cached results can be reused
+		QFileInfo info(QString::fromStdString(path));
+		QCryptographicHash hash(QCryptographicHash::Sha1);
+		hash.addData(info.absoluteFilePath().toUtf8());
+		hash.addData(QByteArray::number(info.size()));
+		hash.addData(QByteArray::number(info.lastModified().toMSecsSinceEpoch()));
+		hash.addData(QByteArray::number(slices));
+		inputKey = hash.result();
+
 		if (ends_with(path, ".vol")) {
+			TraceScope trace("load");
 			input.open(path);
+			trace.addVoxels((double) input.width() * input.height() * input.depth());
 			onInputChanged();
 			return;
 		}
@@ -228,8 +299,9 @@ void VolumeData::save(const QUrl &qPath) {
 			string nameNoExt = path.substr(0, path.length() - 4);
 			for (int z = 0; z < input.depth(); ++z) {
 				for (int y = 0; y < input.height(); ++y) {
+					const float1 *row = input.row(y, z);
 					for (int x = 0; x < input.width(); ++x) {
-						int value = toByte(input.get(x, y, z).value);
+						int value = toByte(row[x].value);
 						image.setPixel(x, y, qRgb(value, value, value));
 					}
 				}
@@ -245,275 +317,527 @@ void VolumeData::save(const QUrl &qPath) {
 void VolumeData::backup() {
 	log() << "backup";
 	this->push("backup", [this]() {
-		input.resize(saved, 0);
+		// backups share the bricks with the input until one of them is modified
+		backups.push_back(saved);
+		while (backups.size() >= (size_t) maxBackups) {
+			backups.pop_front();
+		}
+		saved.assign(input);
+		publish();
 	});
 }
-void VolumeData::restore() {
-	log() << "restore";
-	this->start("restore", [this]() {
-		saved.resize(input, 0);
+void VolumeData::restore(int level) {
+	log() << "restore(level: " << level << ")";
+	this->start("restore", [this, level]() {
+		Volume<float1> before = input;
+		// go back `level` backups, dropping the newer ones
+		for (int i = 0; i < level && !backups.empty(); ++i) {
+			saved.assign(backups.back());
+			backups.pop_back();
+		}
+		input.assign(saved);
+		history.record("restore", before, input);
+		inputKey = uniqueKey();
+		onInputChanged();
+	});
+}
+void VolumeData::undo(int steps) {
+	log() << "undo(steps: " << steps << ")";
+	this->push("undo", [this, steps]() {
+		for (int i = 0; i < steps; ++i) {
+			if (!history.undo(input)) {
+				break;
+			}
+		}
+		inputKey = uniqueKey();
+		onInputChanged();
+	});
+}
+void VolumeData::redo(int steps) {
+	log() << "redo(steps: " << steps << ")";
+	this->push("redo", [this, steps]() {
+		for (int i = 0; i < steps; ++i) {
+			if (!history.redo(input)) {
+				break;
+			}
+		}
+		inputKey = uniqueKey();
 		onInputChanged();
 	});
 }
 
-void VolumeData::threshold(float min, float max, bool normalize) {
-	log() << "threshold(min: " << min << ", max: " << max << ", normalize" << normalize << ")";
-	this->push("threshold", [this, min, max, normalize]() {
-		if (min < max) {
-			input.forEach([&](float1 &voxel) {
+// point-wise operations, they can run in the same pass as a filter
+static RowOperation<float1> thresholdRows(float min, float max, bool normalize) {
+	if (min < max) {
+		return [min, max, normalize](float1 *row, int width, int, int) {
+			for (int x = 0; x < width; ++x) {
+				float1 &voxel = row[x];
 				if (voxel.value < min || voxel.value > max) {
 					voxel = float1::zero;
 				}
 				else if (normalize) {
 					voxel.value = (voxel.value - min) / (max - min);
 				}
-			});
-		}
-		else {
-			input.forEach([&](float1 &voxel) {
-				if (voxel.value < min && voxel.value > max) {
-					voxel = float1::zero;
-				}
-				else if (normalize) {
-					if (voxel.value > min) {
-						voxel.value -= min - max;
-					}
-					voxel.value /= 1 - (min - max);
+			}
+		};
+	}
+	return [min, max, normalize](float1 *row, int width, int, int) {
+		for (int x = 0; x < width; ++x) {
+			float1 &voxel = row[x];
+			if (voxel.value < min && voxel.value > max) {
+				voxel = float1::zero;
+			}
+			else if (normalize) {
+				if (voxel.value > min) {
+					voxel.value -= min - max;
 				}
-			});
+				voxel.value /= 1 - (min - max);
+			}
 		}
-		onInputChanged();
-	});
+	};
 }
-void VolumeData::cutCropSphere(float x, float y, float z, float r, bool crop) {
-	log() << "cutCropSphere(crop: " << crop << ", radius: " << r <<")";
-	this->push("cropSphere", [this, x, y, z, r, crop]() {
-		float sx = input.width();
-		float sy = input.height();
-		float sz = input.depth();
-		float R = r * input.depth();
-		vector3d cut(x * sx, y * sy, z * sz, 0);
-		input.forEach([this, &cut, R, crop](int x, int y, int z) {
+static RowOperation<float1> cutCropSphereRows(const Volume<float1> &volume, float x, float y, float z, float r, bool crop) {
+	float sx = volume.width();
+	float sy = volume.height();
+	float sz = volume.depth();
+	float R = r * volume.depth();
+	vector3d cut(x * sx, y * sy, z * sz, 0);
+	return [cut, R, crop](float1 *row, int width, int y, int z) {
+		for (int x = 0; x < width; ++x) {
 			if (crop == (length(vector3d(x, y, z, 0) - cut) >= R)) {
-				input.set(x, y, z, float1::zero);
+				row[x] = float1::zero;
 			}
-		});
-		onInputChanged();
-	});
+		}
+	};
 }
+static void fillKernel(Kernel<float1> &kernel, VolumeData::KernelType type, float value) {
+	switch (type) {
 
-void VolumeData::fill(KernelType type, int size, float value) {
-	log() << "fill(size: " << size << ", value: " << value << ")";
-	this->push("fill", [this, type, size, value]() {
-		Kernel<float1> kernel(size);
-		switch (type) {
+		case VolumeData::Box:
+			kernel.fill(float1(value));
+			break;
 
-			case Box:
-				kernel.fill(float1(value));
-				break;
+		case VolumeData::Disk:
+			kernel.fillDisk(float1(value));
+			break;
 
-			case Disk:
-				kernel.fillDisk(float1(value));
-				break;
+		case VolumeData::Cross:
+			kernel.fillCross(float1(value));
+			break;
 
-			case Cross:
-				kernel.fillCross(float1(value));
-				break;
+		case VolumeData::Diamond:
+			kernel.fillDiamond(float1(value));
+			break;
 
-			case Diamond:
-				kernel.fillDiamond(float1(value));
-				break;
+		case VolumeData::Gauss:
+			kernel.fillGauss(value);
+			break;
+	}
+}
+// the filters run in place, `pre` and `post` are fused into the same pass
+static void applyFilter(Volume<float1> &volume, VolumeData::FilterType filterType, VolumeData::KernelType kernelType, int kernelSize, float value,
+		const RowOperation<float1> &pre = nullptr, const RowOperation<float1> &post = nullptr) {
+	Kernel<float1> kernel(kernelSize);
+	fillKernel(kernel, kernelType, value);
 
-			case Gauss:
-				kernel.fillGauss(value);
-				break;
+	switch (filterType) {
+
+		case VolumeData::Filter:
+			kernel.filter(volume, pre, post);
+			break;
+
+		case VolumeData::Median:
+			kernel.median(volume, pre, post);
+			break;
+
+		case VolumeData::Erode:
+			kernel.erode(volume, pre, post);
+			break;
+
+		case VolumeData::Dilate:
+			kernel.dilate(volume, pre, post);
+			break;
+	}
+}
+static void applyFilter(Volume<float1> &volume, int size, const QList<qreal> &values,
+		const RowOperation<float1> &pre = nullptr, const RowOperation<float1> &post = nullptr) {
+	Kernel<float1> kernel(size);
+	for (int z = 0; z < size; ++z) {
+		for (int y = 0; y < size; ++y) {
+			for (int x = 0; x < size; ++x) {
+				kernel.set(x, y, z, float1(values[(z * size + y) * size + x]));
+			}
 		}
-		kernel.resize(input, 0);
-		onInputChanged();
-	});
+	}
+	kernel.filter(volume, pre, post);
 }
 
-void VolumeData::filter(FilterType filterType, KernelType kernelType, int kernelSize, float value) {
-	log() << "filter(size: " << kernelSize << ", value: " << value << ")";
-	this->push("filter", [this, filterType, kernelType, kernelSize, value]() {
-		Kernel<float1> kernel(kernelSize);
-		switch (kernelType) {
+typedef function<void(Volume<float1> &volume, const RowOperation<float1> &pre, const RowOperation<float1> &post)> FilterOperation;
 
-			case Box:
-				kernel.fill(float1(value));
-				break;
+// the point-wise operation of the operation list, or null if it is not point-wise
+static RowOperation<float1> rowOperation(const Volume<float1> &volume, const QVariantMap &op) {
+	QString name = op["name"].toString();
+	if (name == "CropSphere" || name == "CutSphere") {
+		return cutCropSphereRows(volume, op["x"].toFloat(), op["y"].toFloat(), op["z"].toFloat(), op["r"].toFloat(), name == "CropSphere");
+	}
+	if (name == "Threshold") {
+		return thresholdRows(op["min"].toFloat(), op["max"].toFloat(), op["norm"].toBool());
+	}
+	return nullptr;
+}
 
-			case Disk:
-				kernel.fillDisk(float1(value));
-				break;
+// the kernel filter of the operation list, or null if it is not a kernel filter
+static FilterOperation filterOperation(const QVariantMap &op) {
+	QString name = op["name"].toString();
+	VolumeData::KernelType kernel = (VolumeData::KernelType) op["kernel"].toInt();
+	int size = op["size"].toInt();
+	auto filter = [kernel, size](VolumeData::FilterType type, float value) -> FilterOperation {
+		return [type, kernel, size, value](Volume<float1> &volume, const RowOperation<float1> &pre, const RowOperation<float1> &post) {
+			applyFilter(volume, type, kernel, size, value, pre, post);
+		};
+	};
+	if (name == "BoxBlur") {
+		return filter(VolumeData::Filter, 1.f / (size * size * size));
+	}
+	if (name == "GaussBlur") {
+		return filter(VolumeData::Filter, size / 4.f);
+	}
+	if (name == "CustomFilter") {
+		QList<qreal> values;
+		for (const QVariant &value : op["values"].toList()) {
+			values.append(value.toReal());
+		}
+		return [size, values](Volume<float1> &volume, const RowOperation<float1> &pre, const RowOperation<float1> &post) {
+			applyFilter(volume, size, values, pre, post);
+		};
+	}
+	if (name == "Erode") {
+		return filter(VolumeData::Erode, 1);
+	}
+	if (name == "Dilate") {
+		return filter(VolumeData::Dilate, 1);
+	}
+	if (name == "Median") {
+		return filter(VolumeData::Median, 1);
+	}
+	return nullptr;
+}
 
-			case Cross:
-				kernel.fillCross(float1(value));
-				break;
+// chain two point-wise operations, any of them can be null
+static RowOperation<float1> fuseRows(const RowOperation<float1> &first, const RowOperation<float1> &second) {
+	if (!first) {
+		return second;
+	}
+	if (!second) {
+		return first;
+	}
+	return [first, second](float1 *row, int width, int y, int z) {
+		first(row, width, y, z);
+		second(row, width, y, z);
+	};
+}
 
-			case Diamond:
-				kernel.fillDiamond(float1(value));
-				break;
+// execute an operation of the operation list
+static void applyOperation(Volume<float1> &volume, const QVariantMap &op) {
+	QString name = op["name"].toString();
+	if (RowOperation<float1> rows = rowOperation(volume, op)) {
+		forEachRow(volume, rows);
+	}
+	else if (FilterOperation filter = filterOperation(op)) {
+		filter(volume, nullptr, nullptr);
+	}
+	else if (name == "Clahe") {
+		equalizeHistogram(volume, op["bins"].toInt(), op["windowSize"].toInt(), op["clipLimit"].toFloat());
+	}
+	else if (name == "ErodeRadius" || name == "DilateRadius" || name == "Shell") {
+		float threshold = op["threshold"].toFloat();
+		float radius = op["radius"].toFloat();
+		auto foreground = [threshold](const float1 &value) {
+			return value.value > threshold;
+		};
+		if (name == "ErodeRadius") {
+			erodeDistance(volume, radius, foreground);
+		}
+		else if (name == "DilateRadius") {
+			dilateDistance(volume, radius, foreground, float1(1));
+		}
+		else {
+			shellDistance(volume, radius, foreground);
+		}
+	}
+	else if (name == "LargestComponent") {
+		float threshold = op["threshold"].toFloat();
+		keepLargestComponent(volume, [threshold](const float1 &value) {
+			return value.value > threshold;
+		});
+	}
+	else {
+		throw runtime_error("Invalid operation: " + name.toStdString());
+	}
+}
 
-			case Gauss:
-				kernel.fillGauss(value);
-				break;
+/**
+ * Execute the operations of the list starting at `index`, returns the index after the last one executed.
+ * The point-wise operations around a kernel filter run in the same pass as the filter,
+ * consecutive point-wise operations run in a single pass.
+ */
+static int applyOperations(Volume<float1> &volume, const QVariantList &operations, int index) {
+	int next = index;
+	RowOperation<float1> pre;
+	for (; next < operations.size(); ++next) {
+		RowOperation<float1> rows = rowOperation(volume, operations[next].toMap());
+		if (!rows) {
+			break;
 		}
+		pre = fuseRows(pre, rows);
+	}
 
-		Volume<float1> temp = input;
-		switch (filterType) {
+	FilterOperation filter = next < operations.size() ? filterOperation(operations[next].toMap()) : nullptr;
+	if (!filter) {
+		if (pre) {
+			forEachRow(volume, pre);
+			return next;
+		}
+		applyOperation(volume, operations[next].toMap());
+		return next + 1;
+	}
 
-			case Filter:
-				kernel.filter(temp, input);
-				break;
+	RowOperation<float1> post;
+	for (next += 1; next < operations.size(); ++next) {
+		RowOperation<float1> rows = rowOperation(volume, operations[next].toMap());
+		if (!rows) {
+			break;
+		}
+		post = fuseRows(post, rows);
+	}
+	filter(volume, pre, post);
+	return next;
+}
 
-			case Median:
-				kernel.median(temp, input);
-				break;
+void VolumeData::threshold(float min, float max, bool normalize) {
+	log() << "threshold(min: " << min << ", max: " << max << ", normalize" << normalize << ")";
+	this->modify("threshold", [this, min, max, normalize]() {
+		forEachRow(input, thresholdRows(min, max, normalize));
+	});
+}
+void VolumeData::cutCropSphere(float x, float y, float z, float r, bool crop) {
+	log() << "cutCropSphere(crop: " << crop << ", radius: " << r <<")";
+	this->modify("cropSphere", [this, x, y, z, r, crop]() {
+		forEachRow(input, cutCropSphereRows(input, x, y, z, r, crop));
+	});
+}
 
-			case Erode:
-				kernel.erode(temp, input);
-				break;
+void VolumeData::fill(KernelType type, int size, float value) {
+	log() << "fill(size: " << size << ", value: " << value << ")";
+	this->modify("fill", [this, type, size, value]() {
+		Kernel<float1> kernel(size);
+		fillKernel(kernel, type, value);
+		kernel.resize(input, ResizeNearest);
+	});
+}
 
-			case Dilate:
-				kernel.dilate(temp, input);
-				break;
-		}
-		onInputChanged();
+void VolumeData::filter(FilterType filterType, KernelType kernelType, int kernelSize, float value) {
+	log() << "filter(size: " << kernelSize << ", value: " << value << ")";
+	this->modify("filter", [this, filterType, kernelType, kernelSize, value]() {
+		applyFilter(input, filterType, kernelType, kernelSize, value);
 	});
 }
 void VolumeData::filter(int size, QList<qreal> values) {
 	log() << "filter(size: " << size << ", values: " << values.size() << ")";
-	this->push("filter", [this, size, values]() {
-		Kernel<float1> kernel(size);
-		for (int z = 0; z < size; ++z) {
-			for (int y = 0; y < size; ++y) {
-				for (int x = 0; x < size; ++x) {
-					kernel.set(x, y, z, float1(values[(z * size + y) * size + x]));
-				}
-			}
-		}
-
-		Volume<float1> temp = input;	// make a copy
-		kernel.filter(temp, input);
-
-		onInputChanged();
+	this->modify("filter", [this, size, values]() {
+		applyFilter(input, size, values);
 	});
 }
 
-// TODO: currently the algorithm is applied to each slice(2D), make it work in 3D
 void VolumeData::clahe(int bins, int windowSize, float clipLimit) {
 	log() << "clahe(bins: " << bins << ", windowSize: " << windowSize << ", clipLimit: " << clipLimit << ")";
-	this->push("clahe", [this, bins, windowSize, clipLimit]() {
-		// Setup.
-		int *H = new int[bins + 1];
-		int *SH = new int[bins + 1];
-		int radius = (windowSize - 1) / 2;
-
-		Volume<float1> src = input;	// make a copy
-		Volume<float1> &out = input;	// link only
+	this->modify("clahe", [this, bins, windowSize, clipLimit]() {
+		equalizeHistogram(input, bins, windowSize, clipLimit);
+	});
+}
 
-		int width = src.width();
-		int height = src.height();
-		int slices = src.depth();
+void VolumeData::largestComponent(float threshold) {
+	log() << "largestComponent(threshold: " << threshold << ")";
+	this->modify("largestComponent", [this, threshold]() {
+		size_t components = keepLargestComponent(input, [threshold](const float1 &value) {
+			return value.value > threshold;
+		});
+		log() << "components found: " << components;
+	});
+}
 
-		for (int z = 0; z < slices; ++z) {
-			int area = 0;
-			memset(H, 0, (bins + 1) * sizeof(int));
+void VolumeData::gradient(float sigma) {
+	log() << "gradient(sigma: " << sigma << ")";
+	this->push("gradient", [this, sigma]() {
+		if (result == nullptr || result->width() != input.width() || result->height() != input.height() || result->depth() != input.depth()) {
+			result.reset(new Volume<normal4>(Volume<normal4>::uninitialized(input.width(), input.height(), input.depth())));
+		}
+		// the result is written into new bricks, the published ones stay valid for the renderer
+		computeGradient(input, *result, sigma);
+		{
+			QMutexLocker lock(&viewLock);
+			resultView.reset(new Volume<normal4>(*result));
+		}
+		emit volumeChanged();
+	});
+}
 
-			for (int y = 0; y < height; ++y) {
-				// Find height of addition/subtraction boxes.
-				int yMin = max(0, y - radius);
-				int yMax = min(height, y + radius + 1);
-
-				// Find height of addition/subtraction boxes.
-				for (int x = -radius; x < width + radius; ++x) {
-
-					// Remove pixels on the left edge.
-					int subi = x - radius;
-					if (subi >= 0) {
-						// Create histogram, don't scale.
-						for (int jj = yMin; jj < yMax; ++jj) {
-							int idx = bins * src.get(subi, jj, z).value;
-							H[idx] -= 1;
-						}
-						// Modify histogram size (for later scaling).
-						area -= yMax - yMin;
-					}
+void VolumeData::apply(const QVariantList &operations) {
+	log() << "apply(operations: " << operations.size() << ")";
+	this->push("apply", [this, operations]() {
+		// applying again the last operation list starts from the same input, replacing its result
+		if (inputKey != pipelineOutputKey) {
+			pipelineInput.assign(input);
+			pipelineInputKey = inputKey;
+		}
 
-					// Add pixels on the right edge.
-					int addi = x + radius;
-					if (addi < width) {
-						// Create histogram, don't scale.
-						for (int jj = yMin; jj < yMax; ++jj) {
-							int idx = bins * src.get(addi, jj, z).value;
-							H[idx] += 1;
-						}
-						// Modify histogram size (for later scaling).
-						area += yMax - yMin;
-					}
+		// the key of each intermediate result is the hash of the previous key and the operation
+		vector<QByteArray> keys;
+		QByteArray key = pipelineInputKey;
+		for (const QVariant &operation : operations) {
+			QCryptographicHash hash(QCryptographicHash::Sha1);
+			hash.addData(key);
+			hash.addData(QJsonDocument(QJsonObject::fromVariantMap(operation.toMap())).toJson(QJsonDocument::Compact));
+			key = hash.result();
+			keys.push_back(key);
+		}
 
-					if (x >= 0 && x < width) {
-						// Update pixel value.
-						int idx = bins * src.get(x, y, z).value;
-						float val = 0;
-
-						// Crop off the top
-						float cropped = 0;
-						memcpy(SH, H, (bins + 1) * sizeof(int));
-
-						int limit = clipLimit * area / bins;
-						for (int l = 0; l < bins; ++l) {
-							int d = SH[l] - limit;
-							if (d > 0) {
-								cropped += d;
-								SH[l] = limit;
-							}
-						}
-
-						// Spread out the cropped area. Generate CDF.
-						float spread = cropped / bins;
-						for (int l = 0; l < idx; ++l) {
-							val += SH[l] + spread;
-						}
-
-						// Convert to true CDF value;
-						out.set(x, y, z, float1(val / area));
-					}
-				}
-			}
+		// resume from the last cached intermediate result
+		Volume<float1> volume = pipelineInput;
+		size_t first = keys.size();
+		while (first > 0 && !cache.find(keys[first - 1], volume)) {
+			first -= 1;
 		}
-		delete []H;
-		delete []SH;
+		if (first > 0) {
+			log() << "apply: resuming after operation " << first;
+		}
+		for (size_t i = first; i < keys.size(); ) {
+			// the intermediate results of the fused operations are not cached
+			i = applyOperations(volume, operations, i);
+			cache.insert(keys[i - 1], volume);
+		}
+
+		Volume<float1> before = input;
+		input.assign(volume);
+		history.record("apply", before, input);
+		inputKey = pipelineOutputKey = key;
 		onInputChanged();
 	});
 }
 
+QVariantMap VolumeData::statistics(int bins, const QList<qreal> &percentiles) {
+	QMutexLocker lock(&statsLock);
+	const VolumeStats &stats = inputStats.stats();
+	QVariantMap result;
+	result["min"] = stats.min;
+	result["max"] = stats.max;
+	result["mean"] = stats.mean();
+	result["stddev"] = stats.stddev();
+
+	QVariantList histogram;
+	for (size_t count : inputStats.histogram(bins)) {
+		histogram.append(stats.count > 0 ? (qreal) count / stats.count : 0);
+	}
+	result["histogram"] = histogram;
+
+	QVariantList values;
+	for (qreal percentile : percentiles) {
+		values.append(inputStats.percentile(percentile));
+	}
+	result["percentiles"] = values;
+	return result;
+}
+
+// the totals of the recorded phases, the times are in milliseconds, the peak memory in megabytes
+QVariantList VolumeData::profile() {
+	QVariantList result;
+	for (const VolumeTrace::Summary &summary : VolumeTrace::instance().summary()) {
+		QVariantMap row;
+		row["name"] = QString::fromStdString(summary.name);
+		row["count"] = (qulonglong) summary.count;
+		row["total"] = summary.total;
+		row["max"] = summary.max;
+		row["voxelsPerSecond"] = summary.voxelsPerSecond();
+		row["utilization"] = summary.utilization();
+		row["peak"] = summary.peak / (1024. * 1024.);
+		result.append(row);
+	}
+	return result;
+}
+void VolumeData::clearTrace() {
+	VolumeTrace::instance().clear();
+}
+bool VolumeData::saveTrace(const QUrl &qPath) {
+	QString path = qPath.toLocalFile();
+	string trace = VolumeTrace::instance().chromeTrace();
+	QFile file(path);
+	if (!file.open(QIODevice::WriteOnly) || file.write(trace.data(), trace.size()) != (qint64) trace.size()) {
+		log() << "failed to save trace: " << path.toStdString();
+		return false;
+	}
+	log() << "trace saved: " << path.toStdString();
+	return true;
+}
+
+bool VolumeData::pick(VolumeRenderer *renderer, float x, float y, float result[3]) {
+	TraceScope trace("pick");
+	viewLock.lock();
+	const Volume<float1> volume = inputView;
+	viewLock.unlock();
+
+	QMutexLocker lock(&pickLock);
+	const auto occupied = [](const float1 &value) { return value.value != 0; };
+	if (pickSource == nullptr || pickSource->width() != volume.width() || pickSource->height() != volume.height() || pickSource->depth() != volume.depth()) {
+		pickOccupancy.reset(new VolumeOccupancy<float1>(volume, occupied));
+	}
+	else {
+		for (unsigned brick = 0; brick < volume.brickCount(); ++brick) {
+			if (!volume.sharesBrick(*pickSource, brick)) {
+				int z = volume.brickSlice(brick);
+				pickOccupancy->update(volume, z, z + volume.brickDepth(brick), occupied);
+			}
+		}
+	}
+	pickSource.reset(new Volume<float1>(volume));
+	return renderer->pick(volume, *pickOccupancy, x, y, result);
+}
+
 void VolumeData::updateVolume(VolumeRenderer *renderer, ViewVolume view, float sphere[4]) {
 	// FIXME: start computations on a new thread, try to use OpenGL render queue
+
+	// the copies keep the published bricks alive while an operation modifies the volumes
+	viewLock.lock();
+	const Volume<float1> input = inputView;
+	const Volume<float1> saved = savedView;
+	const unique_ptr<Volume<normal4>> result(resultView != nullptr ? new Volume<normal4>(*resultView) : nullptr);
+	viewLock.unlock();
+
 	switch (view) {
 		case Thumb:
 			if (thumbDirty) {
-				input.resize(thumb, 1);
+				input.resize(thumb, ResizeLinear);
 				thumbDirty = false;
 			}
 			renderer->setVolume(this->thumb, sphere);
 			break;
 
 		case Input:
-			renderer->setVolume(this->input, sphere);
+			renderer->setVolume(input, sphere);
 			break;
 
 		case Backup:
-			renderer->setVolume(this->saved, sphere);
+			renderer->setVolume(saved, sphere);
 			break;
 
 		case Output:
-			renderer->setVolume(this->result, sphere);
+			// nothing to show until the gradient is computed
+			if (result != nullptr) {
+				renderer->setVolume(*result, sphere);
+			}
 			break;
 
 		case Positions:
-			renderer->setPositions(this->input);
+			renderer->setPositions(input);
 			break;
 	}
 }
@@ -6,17 +6,27 @@
 #include "voxel.h"
 #include "voxel_float1.h"
 #include "voxel_float4.h"
+#include "voxel_normal.h"
 
 #include "volume.h"
+#include "volume_history.h"
+#include "volume_cache.h"
+#include "volume_stats.h"
 #include "volume_renderer.h"
+#include "volume_trace.h"
 
 #include <QThreadPool>
 #include <QElapsedTimer>
+#include <QTimer>
+#include <QMutex>
+#include <QStandardPaths>
 #include <QQuickWindow>
 #include <QQuickItem>
 
+#include <atomic>
 #include <sstream>
 #include <ostream>
+#include <deque>
 
 class VolumeExecutor : public QObject {
 	Q_OBJECT
@@ -25,6 +35,11 @@ protected:
 	QThreadPool executor;
 	QElapsedTimer timer;
 
+	// cancel flags of the tasks which did not finish yet, each task owns its flag
+	QMutex cancelLock;
+	vector<weak_ptr<atomic<bool>>> cancelFlags;
+	friend struct Task;
+
 public:
 	VolumeExecutor() {
 	}
@@ -44,6 +59,9 @@ public:
 	void push(const QString &operation, const function<void()> &action);
 	bool join(int timeout = -1);
 
+	// the task running on the calling thread was replaced by start, long tasks may check it to stop early
+	static bool cancelled();
+
 	inline void push(const function<void()> &action) {
 		push("", action);
 	}
@@ -58,13 +76,48 @@ signals:
 class VolumeData : public VolumeExecutor {
 	Q_OBJECT
 	Q_PROPERTY(int maxThreads READ maxThreads WRITE maxThreads)
+	Q_PROPERTY(int backupLevels READ backupLevels WRITE backupLevels)
+	Q_PROPERTY(int undoMemory READ undoMemory WRITE undoMemory)
+	Q_PROPERTY(int cacheMemory READ cacheMemory WRITE cacheMemory)
+	Q_PROPERTY(int cacheDisk READ cacheDisk WRITE cacheDisk)
+	Q_PROPERTY(bool tracing READ tracing WRITE tracing)
 
 	Volume<float1> thumb;
 	Volume<float1> input;
 	Volume<float1> saved;
-	Volume<float4> result;
+	// gradient of the input, allocated when first computed
+	unique_ptr<Volume<normal4>> result;
 	volatile bool thumbDirty = false;
 
+	// older backups sharing the unmodified bricks, the most recent one is the last
+	deque<Volume<float1>> backups;
+	int maxBackups = 4;
+
+	// compressed bricks modified by the operations, used to undo and redo them
+	VolumeHistory<float1> history;
+
+	// intermediate results of the operation lists, keyed by the hash of the input and the operations
+	VolumeCache<float1> cache;
+	QByteArray inputKey;
+	Volume<float1> pipelineInput;
+	QByteArray pipelineInputKey;
+	QByteArray pipelineOutputKey;
+
+	// snapshots of the input, backup and result shown by the renderer, published when an operation completes
+	QMutex viewLock;
+	Volume<float1> inputView;
+	Volume<float1> savedView;
+	unique_ptr<Volume<normal4>> resultView;
+
+	// statistics of the published input, updated by the tasks only from the modified bricks
+	QMutex statsLock;
+	VolumeStatistics inputStats;
+
+	// occupancy of the published input used to pick the voxels, updated only from the modified bricks
+	QMutex pickLock;
+	unique_ptr<Volume<float1>> pickSource;
+	unique_ptr<VolumeOccupancy<float1>> pickOccupancy;
+
 	static constexpr qint64 SEC_MILLIS = 1000;
 	static constexpr qint64 MIN_MILLIS = 60 * SEC_MILLIS;
 	static constexpr qint64 HOUR_MILLIS = 60 * MIN_MILLIS;
@@ -72,101 +125,67 @@ class VolumeData : public VolumeExecutor {
 
 	void readSlices(const string &path, int width, int height, unsigned blurSize, int slices, const function<void(const string &path, Volume<float1> &volume, int z)> &readSlice);
 	void onInputChanged();
+	void publish();
+	void modify(const QString &operation, const function<void()> &action);
+	static QByteArray uniqueKey();
 protected:
 	class Logger {
 		VolumeData *log;
 		const qint64 elapsed;
-	public:
-		stringbuf *out;
+		// formatted in place, the message is emitted when the logger is destroyed
+		ostringstream out;
 
+	public:
 		explicit Logger(VolumeData *self) : Logger(self, -1) {}
 		Logger(VolumeData *self, qint64 elapsed)
 			: log(self), elapsed(elapsed) {
-			out = new stringbuf();
+		}
+		Logger(Logger &&other)
+			: log(other.log), elapsed(other.elapsed), out(std::move(other.out)) {
+			other.log = nullptr;
 		}
 		~Logger() {
 			dump();
-			delete out;
 		}
 
 		void dump() {
-			string str = out->str();
-			qint64 global = this->log->timer.elapsed();
-			if (this->log != nullptr) {
-				if (elapsed < 0) {
-					emit this->log->operationStart(global, QString::fromStdString(str));
-				}
-				else {
-					emit this->log->operationComplete(global, elapsed, QString::fromStdString(str));
-				}
+			if (this->log == nullptr) {
+				return;
 			}
-			/*const char *unit = "ms";
-			double time = global;
-			if (time > DAY_MILLIS) {
-				time /= DAY_MILLIS;
-				unit = "d";
-			}
-			else if (time > HOUR_MILLIS) {
-				time /= HOUR_MILLIS;
-				unit = "h";
-			}
-			else if (time > MIN_MILLIS) {
-				time /= MIN_MILLIS;
-				unit = "m";
+			QString str = QString::fromStdString(out.str());
+			qint64 global = this->log->timer.elapsed();
+			if (elapsed < 0) {
+				emit this->log->operationStart(global, str);
 			}
 			else {
-				time /= SEC_MILLIS;
-				unit = "s";
+				emit this->log->operationComplete(global, elapsed, str);
 			}
-			cout << "[" << QString::asprintf("%05.1f %s", time, unit).toStdString() << "] "<< str << endl;
-			// */
 		}
 
-		Logger &operator <<(const string &value) {
-			std::ostream(out) << value;
-			return *this;
-		}
-		Logger &operator <<(const float &value) {
-			std::ostream(out) << value;
-			return *this;
-		}
-		Logger &operator <<(const double &value) {
-			std::ostream(out) << value;
-			return *this;
-		}
-		Logger &operator <<(const bool &value) {
-			std::ostream(out) << value;
-			return *this;
-		}
-		Logger &operator <<(const signed &value) {
-			std::ostream(out) << value;
-			return *this;
-		}
-		Logger &operator <<(const unsigned &value) {
-			std::ostream(out) << value;
-			return *this;
-		}
-		Logger &operator <<(const size_t &value) {
-			std::ostream(out) << value;
-			return *this;
-		}
-		Logger &operator <<(const char *value) {
-			std::ostream(out) << value;
+		template <class T>
+		Logger &operator <<(const T &value) {
+			out << value;
 			return *this;
 		}
 		Logger &operator <<(const QColor &value) {
-			std::ostream(out) << std::hex << value.rgb();
+			out << std::hex << value.rgb() << std::dec;
 			return *this;
 		}
 	};
 
 protected:
 	explicit VolumeData();
+	// the volumes share a zero brick until written, so the memory is allocated on first use
 	VolumeData(unsigned size, unsigned thumbSize)
-		: thumb(thumbSize)
-		, input(size, size, size)
-		, saved(size, size, size)
-		, result(size, size, size) {
+		: thumb(Volume<float1>::zeros(thumbSize, thumbSize, thumbSize))
+		, input(Volume<float1>::zeros(size, size, size))
+		, saved(Volume<float1>::zeros(size, size, size))
+		, history(512 << 20)
+		, cache((size_t) 1024 << 20, (qint64) 4096 << 20, QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/volumes")
+		, inputKey(uniqueKey())
+		, pipelineInput(input)
+		, inputView(input)
+		, savedView(saved) {
 		timer.start();
 	}
 	Logger log() {
@@ -181,6 +200,23 @@ public:
 	int maxThreads() const { return executor.maxThreadCount(); }
 	void maxThreads(int value) { executor.setMaxThreadCount(value); }
 
+	int backupLevels() const { return maxBackups; }
+	void backupLevels(int value) { maxBackups = value > 1 ? value : 1; }
+
+	// memory used by the undo history in megabytes
+	int undoMemory() const { return history.memoryBudget() >> 20; }
+	void undoMemory(int value) { history.memoryBudget((size_t) (value > 0 ? value : 0) << 20); }
+
+	// memory and disk space used to cache the results of the operation lists in megabytes
+	int cacheMemory() const { return cache.memory() >> 20; }
+	void cacheMemory(int value) { cache.memory((size_t) (value > 0 ? value : 0) << 20); }
+	int cacheDisk() const { return cache.disk() >> 20; }
+	void cacheDisk(int value) { cache.disk((qint64) (value > 0 ? value : 0) << 20); }
+
+	// record the timed phases of the operations, see profile() and saveTrace()
+	bool tracing() const { return VolumeTrace::instance().enabled(); }
+	void tracing(bool value) { VolumeTrace::instance().enabled(value); }
+
 	enum ViewVolume {
 		Thumb, Input, Backup, Positions, Output
 	};
@@ -198,7 +234,9 @@ public:
 
 	Q_INVOKABLE void fill(KernelType type, int size, float value);
 	Q_INVOKABLE void backup();
-	Q_INVOKABLE void restore();
+	Q_INVOKABLE void restore(int level = 0);
+	Q_INVOKABLE void undo(int steps = 1);
+	Q_INVOKABLE void redo(int steps = 1);
 
 	Q_INVOKABLE void open(const QUrl &path, int slices = 0);
 	Q_INVOKABLE void save(const QUrl &path);
@@ -208,8 +246,18 @@ public:
 	Q_INVOKABLE void filter(FilterType filterType, KernelType kernelType, int kernelSize, float value);
 	Q_INVOKABLE void filter(int kernelSize, QList<qreal> values);
 	Q_INVOKABLE void clahe(int bins, int windowSize, float clipLimit);
+	Q_INVOKABLE void largestComponent(float threshold);
+	Q_INVOKABLE void gradient(float sigma = 0);
+	Q_INVOKABLE void apply(const QVariantList &operations);
+
+	Q_INVOKABLE QVariantMap statistics(int bins = 256, const QList<qreal> &percentiles = QList<qreal>());
+
+	Q_INVOKABLE QVariantList profile();
+	Q_INVOKABLE void clearTrace();
+	Q_INVOKABLE bool saveTrace(const QUrl &path);
 
 	Q_INVOKABLE void updateVolume(VolumeRenderer *renderer, ViewVolume view, float sphere[4]);
+	bool pick(VolumeRenderer *renderer, float x, float y, float result[3]);
 };
 
 class VolumeWindow: public QQuickWindow, protected VolumeRenderer {
@@ -225,6 +273,11 @@ class VolumeWindow: public QQuickWindow, protected VolumeRenderer {
 
 	Q_PROPERTY(qreal plane READ getPlane WRITE plane NOTIFY viewChanged)
 	Q_PROPERTY(qreal zoom READ getZoom WRITE zoom NOTIFY viewChanged)
+	Q_PROPERTY(qreal sampling READ getSampling WRITE setSampling NOTIFY viewChanged)
+	Q_PROPERTY(qreal frameTarget READ getFrameTarget WRITE setFrameTarget NOTIFY viewChanged)
+
+	Q_PROPERTY(QVariantMap frameTimes READ frameTimes NOTIFY framesChanged)
+	Q_PROPERTY(bool frameOverlay READ frameOverlay WRITE frameOverlay)
 
 public:
 	explicit VolumeWindow(QQuickWindow *parent = nullptr);
@@ -310,6 +363,23 @@ protected:
 		}
 	}
 
+	// slices per voxel of the refined frames
+	Q_INVOKABLE float getSampling() const { return VolumeRenderer::sampling; }
+	void setSampling(float value) {
+		if (VolumeRenderer::sampling != value) {
+			VolumeRenderer::sampling = value;
+			requestRender(ViewChanged);
+		}
+	}
+	// milliseconds of the frames drawn while the view changes, the level of detail is lowered to meet it
+	Q_INVOKABLE float getFrameTarget() const { return VolumeRenderer::frameTarget; }
+	void setFrameTarget(float value) {
+		if (VolumeRenderer::frameTarget != value) {
+			VolumeRenderer::frameTarget = value;
+			requestRender(ViewChanged);
+		}
+	}
+
 	Q_INVOKABLE float getPlane() const { return vol3dTranslate; }
 	void plane(float value) {
 		if (this->vol3dTranslate != value) {
@@ -329,6 +399,35 @@ protected:
 		VolumeRenderer::adjust(brightness, contrast, gamma);
 	}
 
+	// percentiles of the recent timings of each rendering stage, in milliseconds
+	QVariantMap frameTimes() const {
+		QVariantMap result;
+		for (int i = 0; i < FrameProfile::StageCount; ++i) {
+			FrameProfile::Stage stage = (FrameProfile::Stage) i;
+			FrameProfile::Percentiles time = frames.percentiles(stage);
+			QVariantMap values;
+			values["count"] = (qulonglong) time.count;
+			values["p50"] = time.p50;
+			values["p95"] = time.p95;
+			values["p99"] = time.p99;
+			values["max"] = time.max;
+			result[FrameProfile::name(stage)] = values;
+		}
+		return result;
+	}
+	Q_INVOKABLE void clearFrames() {
+		frames.clear();
+		emit framesChanged();
+	}
+
+	bool frameOverlay() const { return showFrames; }
+	void frameOverlay(bool value) {
+		if (showFrames != value) {
+			showFrames = value;
+			requestRender(ViewChanged);
+		}
+	}
+
 	Q_INVOKABLE void render(int show) {
 		if (!this->isExposed()) {
 			// no need to draw anything while window is not visible
@@ -395,7 +494,8 @@ protected:
 			case ModelChanged:
 				emit modelChanged();
 				_resetModel = true;
-				// fall through
+				emit viewChanged();
+				break;
 
 			case SizeChanged:
 				_resetView = true;
@@ -403,23 +503,42 @@ protected:
 
 			case ViewChanged:
 				emit viewChanged();
+				// draw at the interactive level until the view stops changing
+				detail = interactiveDetail;
+				refineTimer.start(RefineDelay);
 				break;
 		}
 		requestUpdate();
 	}
 
+	// draw the next level of detail, called when the view did not change for a while and after each refined frame
+	void refineDetail() {
+		if (detail > 0) {
+			detail -= 1;
+			requestUpdate();
+		}
+	}
+
 	QSurface* getSurface() override { return this; }
 
 	VolumeData *model = nullptr;
 	QPoint mouse;
 
+	// limits the notifications of the frame timings
+	QElapsedTimer framesNotified;
+
+	// started by each change of the view, the refinement begins when it expires
+	enum { RefineDelay = 150 };
+	QTimer refineTimer;
+
 signals:
 	void thresholdChanged();
 	void alphaChanged();
 
-	void viewChanged();		// rotaton/translation: just re-draw the display list
-	void modelChanged();	// zoom/model: needs to reconstruct the display list
+	void viewChanged();		// rotaton/translation: just re-draw the slices
+	void modelChanged();	// model: needs to upload the texture
 	void volumeChanged();	// threshold, brightness, etc: needs to recreate 3d texture from model
+	void framesChanged();	// new frame timings, notified at most twice a second
 
 	void mouseDrag(int btn, int dx, int dy);
 	void mouseScroll(qreal dx);
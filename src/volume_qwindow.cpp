@@ -7,6 +7,9 @@ VolumeWindow::VolumeWindow(QQuickWindow *parent)
 	: QQuickWindow(parent), VolumeRenderer() {
 	setSurfaceType(QWindow::OpenGLSurface);
 	reset();
+
+	refineTimer.setSingleShot(true);
+	connect(&refineTimer, &QTimer::timeout, this, &VolumeWindow::refineDetail);
 }
 
 VolumeWindow::~VolumeWindow() {
@@ -25,6 +28,17 @@ bool VolumeWindow::event(QEvent *event) {
 			case QEvent::Expose:
 			case QEvent::UpdateRequest:
 				renderGl(nullptr);
+				if (refineTimer.isActive()) {
+					// the view is changing, keep the interactive frames near the target time
+					adaptDetail();
+				}
+				else {
+					refineDetail();
+				}
+				if (!framesNotified.isValid() || framesNotified.elapsed() > 500) {
+					framesNotified.start();
+					emit framesChanged();
+				}
 				return true;
 		}
 	}
@@ -52,14 +66,10 @@ void VolumeWindow::wheelEvent(QWheelEvent *event) {
 }
 
 void VolumeWindow::mouseDoubleClickEvent(QMouseEvent *event) {
-	float pos[4] = {-1, -1, -1, -1};
+	// the coordinates of the visible voxel under the cursor, -1 if there is none
+	float pos[3] = {-1, -1, -1};
 	if (this->model != nullptr) {
-		if (event->button() == Qt::LeftButton) {
-			this->model->updateVolume(this, VolumeData::Positions, nullptr);
-		}
-		pos[0] = event->pos().x();
-		pos[1] = event->pos().y();
-		renderGl(nullptr, pos);
+		this->model->pick(this, event->pos().x(), event->pos().y(), pos);
 	}
 	emit mouseSelect(event->button(), pos[0], pos[1], pos[2]);
 }
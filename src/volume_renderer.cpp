@@ -1,14 +1,65 @@
 #include "volume_quick.h"
 
+#include <QOffscreenSurface>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLPaintDevice>
+#include <QPainter>
+#include <QDebug>
+#include <cstring>
+
 static const float ZOOM = sqrtf(3);
 
+static const char *VERTEX_SHADER = R"(
+varying vec3 position;
+
+void main() {
+	position = (gl_TextureMatrix[0] * gl_MultiTexCoord0).xyz;
+	gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+}
+)";
+
+// the value of the voxel is colored by the transfer function, the shell of the sphere is highlighted
+static const char *FRAGMENT_SHADER = R"(
+uniform sampler3D volume;
+uniform sampler1D transfer;
+uniform vec3 size;
+uniform vec4 sphere;
+uniform float border;
+uniform vec4 highlight;
+uniform float spacing;
+varying vec3 position;
+
+void main() {
+	if (any(lessThan(position, vec3(0.))) || any(greaterThan(position, vec3(1.)))) {
+		discard;
+	}
+	if (sphere.w >= 0.) {
+		float d = length(position * size - sphere.xyz);
+		if (d > sphere.w && d < sphere.w + border) {
+			gl_FragColor = highlight;
+			return;
+		}
+	}
+	float value = texture3D(volume, position).r;
+	vec4 color = texture1D(transfer, value * (255. / 256.) + .5 / 256.);
+	// the opacity of the transfer function is for slices one voxel apart
+	color.a = 1. - pow(1. - color.a, spacing);
+	gl_FragColor = color;
+}
+)";
+
 VolumeRenderer::~VolumeRenderer() {
 	if (vol3dTexId != 0) {
 		this->glDeleteTextures(1, &vol3dTexId);
 	}
-	if (vol3dListId != 0) {
-		this->glDeleteLists(vol3dListId, 1);
+	if (vol3dPboId != 0) {
+		this->glDeleteBuffers(1, &vol3dPboId);
+	}
+	if (vol3dTfId != 0) {
+		this->glDeleteTextures(1, &vol3dTfId);
 	}
+	delete this->vol3dShader;
+	delete this->vol3dSource;
 	delete []this->vol3dData;
 }
 
@@ -25,28 +76,21 @@ void VolumeRenderer::initializeOpenGL() {
 
 void VolumeRenderer::renderModel(QSurface *surface, const QRect* roi) {
 	if (_resetModel) {
-		_resetView = true;
 		_resetModel = false;
-		if (vol3dTexId != 0) {
-			this->glDeleteTextures(1, &vol3dTexId);
-		}
-
 		if (vol3dData != nullptr) {
-			this->glGenTextures(1, &vol3dTexId);
-			this->glBindTexture(GL_TEXTURE_3D, vol3dTexId);
-			this->glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-			this->glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-			this->glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-			this->glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
-			this->glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			this->glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			this->glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA, vol3dSizeX, vol3dSizeY, vol3dSizeZ, 0, GL_RGBA, GL_UNSIGNED_BYTE, vol3dData);
-			this->glBindTexture(GL_TEXTURE_3D, 0);
+			TraceScope trace("render.upload", (double) vol3dSizeX * vol3dSizeY * vol3dSizeZ);
+			const double started = FrameProfile::now();
+			uploadTexture();
+			if (vol3dShader != nullptr && vol3dTransferDirty) {
+				uploadTransfer();
+			}
+			frames.add(FrameProfile::Upload, FrameProfile::now() - started);
 		}
 	}
 
 	if (_resetView) {
 		_resetView = false;
+		const double started = FrameProfile::now();
 
 		this->glClearColor(qRed(this->backgroundColor) / 255.f,
 						   qGreen(this->backgroundColor) / 255.f,
@@ -78,30 +122,17 @@ void VolumeRenderer::renderModel(QSurface *surface, const QRect* roi) {
 		this->glOrtho(-aspect, aspect, 1, -1, 1, -1);
 		this->glMatrixMode(GL_MODELVIEW);
 		this->glLoadIdentity();
-
-		if (vol3dListId != 0) {
-			this->glDeleteLists(vol3dListId, 1);
-		}
-		vol3dListId = this->glGenLists(1);
-		this->glNewList(vol3dListId, GL_COMPILE);
-		this->glBindTexture(GL_TEXTURE_3D, vol3dTexId);
-		for (size_t i = 0; i < vol3dSizeZ; ++i) {
-			float texIdx = i / (float)vol3dSizeZ;
-			float vtxIdx = 2 * texIdx - 1;
-			this->glBegin(GL_QUADS);
-			this->glTexCoord3f(0, 0, texIdx);
-			this->glVertex3f(-vol3dZoom, -vol3dZoom, vtxIdx);
-			this->glTexCoord3f(1, 0, texIdx);
-			this->glVertex3f(vol3dZoom, -vol3dZoom, vtxIdx);
-			this->glTexCoord3f(1, 1, texIdx);
-			this->glVertex3f(vol3dZoom, vol3dZoom, vtxIdx);
-			this->glTexCoord3f(0, 1, texIdx);
-			this->glVertex3f(-vol3dZoom, vol3dZoom, vtxIdx);
-			this->glEnd();
-		}
-		this->glEndList();
 	}
 
+	// the slices are recomputed for each view, they are clipped to the volume
+	const matrix3d texture = textureMatrix();
+	double started = FrameProfile::now();
+	vol3dFrameStarted = started;
+	buildSlices(texture);
+	frames.add(FrameProfile::Build, FrameProfile::now() - started);
+
+	started = FrameProfile::now();
+
 	if (roi != nullptr) {
 		this->glEnable(GL_SCISSOR_TEST);
 		glDisable(GL_DEPTH_TEST);
@@ -112,31 +143,516 @@ void VolumeRenderer::renderModel(QSurface *surface, const QRect* roi) {
 	this->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	this->glMatrixMode(GL_TEXTURE);
-	this->glLoadIdentity();
-
-	// Translate and make 0.5f as the center
-	// (texture coordinate is from 0 to 1. so center of rotation has to be 0.5f)
-	this->glTranslatef(+.5f, +.5f, +.5f);
-
-	matrix3d transform = this->vol3dTransform;
-
-	transform *= translate(vol3dTranslate, vector3d(0, 0, ZOOM));
 	float matrix[16];
 	for (int i = 0; i < 16; ++i) {
-		matrix[i] = transform[i % 4][i / 4];
+		matrix[i] = texture[i % 4][i / 4];
 	}
-	this->glMultMatrixf(matrix);
-
-	// make sure that volume fits on screen however we rotate it
-	this->glScalef(ZOOM, ZOOM, ZOOM);
-
-	this->glTranslatef(-.5f, -.5f, -.5f);
+	this->glLoadMatrixf(matrix);
+	this->glMatrixMode(GL_MODELVIEW);
 
 	// render the volume
-	this->glCallList(vol3dListId);
+	const bool shaded = vol3dShader != nullptr && vol3dChannels == 1;
+	if (shaded) {
+		vol3dShader->bind();
+		vol3dShader->setUniformValue("volume", 0);
+		vol3dShader->setUniformValue("transfer", 1);
+		vol3dShader->setUniformValue("size", (GLfloat) vol3dSizeX, (GLfloat) vol3dSizeY, (GLfloat) vol3dSizeZ);
+		vol3dShader->setUniformValue("sphere", vol3dSphere[0], vol3dSphere[1], vol3dSphere[2], vol3dSphere[3]);
+		vol3dShader->setUniformValue("border", (GLfloat) highlightBorder);
+		vol3dShader->setUniformValue("highlight", QColor::fromRgba(highlightColor));
+		vol3dShader->setUniformValue("spacing", (GLfloat) vol3dSpacing);
+		this->glActiveTexture(GL_TEXTURE1);
+		this->glBindTexture(GL_TEXTURE_1D, vol3dTfId);
+		this->glActiveTexture(GL_TEXTURE0);
+	}
+	if (!vol3dSliceFirst.empty()) {
+		const GLsizei stride = 6 * sizeof(GLfloat);
+		this->glBindTexture(GL_TEXTURE_3D, vol3dTexId);
+		if (vol3dTexLevels > 0) {
+			// sample only the level of the frame, the coarser slices would otherwise select the finer levels
+			const GLfloat level = min(detail, vol3dTexLevels);
+			this->glTexParameterf(GL_TEXTURE_3D, GL_TEXTURE_MIN_LOD, level);
+			this->glTexParameterf(GL_TEXTURE_3D, GL_TEXTURE_MAX_LOD, level);
+		}
+		this->glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		this->glEnableClientState(GL_VERTEX_ARRAY);
+		this->glTexCoordPointer(3, GL_FLOAT, stride, vol3dSlices.data());
+		this->glVertexPointer(3, GL_FLOAT, stride, vol3dSlices.data() + 3);
+		this->glMultiDrawArrays(GL_TRIANGLE_FAN, vol3dSliceFirst.data(), vol3dSliceCount.data(), vol3dSliceFirst.size());
+		this->glDisableClientState(GL_VERTEX_ARRAY);
+		this->glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		this->glBindTexture(GL_TEXTURE_3D, 0);
+	}
+	if (shaded) {
+		this->glActiveTexture(GL_TEXTURE1);
+		this->glBindTexture(GL_TEXTURE_1D, 0);
+		this->glActiveTexture(GL_TEXTURE0);
+		vol3dShader->release();
+	}
 	if (roi != nullptr) {
 		this->glDisable(GL_SCISSOR_TEST);
 	}
+	frames.add(FrameProfile::Draw, FrameProfile::now() - started);
+}
+
+/**
+ * Transformation of the slice coordinates into texture coordinates: the slices are in the xy plane of the
+ * slice space, from 0 to 1 on each axis; the volume is rotated around its center and scaled,
+ * so it fits inside however it is rotated, the plane moves it along the z axis.
+ */
+matrix3d VolumeRenderer::textureMatrix() const {
+	matrix3d result = translate(.5f, vector3d(1, 1, 1));
+	result *= this->vol3dTransform;
+	result *= translate(vol3dTranslate, vector3d(0, 0, ZOOM));
+	result *= scale(ZOOM, vector3d(1, 1, 1));
+	result *= translate(-.5f, vector3d(1, 1, 1));
+	return result;
+}
+
+/**
+ * Intersect the volume with the slices, each slice is a convex polygon drawn as a triangle fan.
+ * The slices are at fixed depths, multiples of the spacing, so they do not move while rotating.
+ */
+void VolumeRenderer::buildSlices(const matrix3d &texture) {
+	static const int edges[12][2] = {
+		{0, 1}, {2, 3}, {4, 5}, {6, 7},
+		{0, 2}, {1, 3}, {4, 6}, {5, 7},
+		{0, 4}, {1, 5}, {2, 6}, {3, 7}
+	};
+
+	vol3dSlices.clear();
+	vol3dSliceFirst.clear();
+	vol3dSliceCount.clear();
+	if (vol3dSizeZ == 0) {
+		return;
+	}
+
+	// the corners of the volume in slice space
+	const matrix3d slices = inverse(texture);
+	vector3d corners[8];
+	scalar zmin = 1, zmax = 0;
+	for (int i = 0; i < 8; ++i) {
+		corners[i] = vph(slices, vector3d(i & 1, i >> 1 & 1, i >> 2 & 1, 1));
+		zmin = min(zmin, corners[i].z);
+		zmax = max(zmax, corners[i].z);
+	}
+	zmin = max(zmin, (scalar) 0);
+	zmax = min(zmax, (scalar) 1);
+
+	// a unit in slice space is `ZOOM` in texture space
+	const float rate = max(sampling / (1 << detail), 1.f / 16);
+	const size_t voxels = max(vol3dSizeX, max(vol3dSizeY, vol3dSizeZ));
+	const scalar step = 1 / (voxels * rate * ZOOM);
+	vol3dSpacing = 1 / rate;
+
+	for (scalar z = ceil(zmin / step) * step; z < zmax; z += step) {
+		vector3d points[6];
+		int count = 0;
+		vector3d center(0, 0, 0, 0);
+		for (const int *edge : edges) {
+			const vector3d &a = corners[edge[0]];
+			const vector3d &b = corners[edge[1]];
+			if ((a.z < z) == (b.z < z) || count == 6) {
+				continue;
+			}
+			points[count] = a + (b - a) * ((z - a.z) / (b.z - a.z));
+			center += points[count];
+			count += 1;
+		}
+		if (count < 3) {
+			continue;
+		}
+
+		// order the points around the center
+		center *= 1.f / count;
+		float angles[6];
+		for (int i = 0; i < count; ++i) {
+			angles[i] = atan2f(points[i].y - center.y, points[i].x - center.x);
+		}
+		for (int i = 1; i < count; ++i) {
+			for (int j = i; j > 0 && angles[j] < angles[j - 1]; --j) {
+				swap(angles[j], angles[j - 1]);
+				swap(points[j], points[j - 1]);
+			}
+		}
+
+		vol3dSliceFirst.push_back(vol3dSlices.size() / 6);
+		vol3dSliceCount.push_back(count);
+		for (int i = 0; i < count; ++i) {
+			const vector3d &point = points[i];
+			vol3dSlices.push_back(point.x);
+			vol3dSlices.push_back(point.y);
+			vol3dSlices.push_back(point.z);
+			vol3dSlices.push_back(vol3dZoom * (2 * point.x - 1));
+			vol3dSlices.push_back(vol3dZoom * (2 * point.y - 1));
+			vol3dSlices.push_back(2 * point.z - 1);
+		}
+	}
+}
+
+/**
+ * The ray through the point (x, y) of the surface, from the front slice to the back one, in texture space.
+ * The inverse of the projection of renderModel and of the vertices of the slices.
+ */
+bool VolumeRenderer::pickRay(float x, float y, vector3d &front, vector3d &back) {
+	QSurface *surface = getSurface();
+	if (surface == nullptr || surface->size().isEmpty()) {
+		return false;
+	}
+	const QSize size = surface->size();
+	const scalar s = ((2 * x - size.width()) / size.height() / vol3dZoom + 1) / 2;
+	const scalar t = ((2 * y / size.height() - 1) / vol3dZoom + 1) / 2;
+
+	// the slices are drawn from back to front, with increasing z
+	const matrix3d texture = textureMatrix();
+	front = vph(texture, vector3d(s, t, 1, 1));
+	back = vph(texture, vector3d(s, t, 0, 1));
+	return true;
+}
+
+void VolumeRenderer::uploadTexture() {
+	// without shaders the scalar volumes are expanded through the transfer function while uploading
+	const bool expand = vol3dChannels == 1 && vol3dShader == nullptr;
+	const GLenum format = vol3dChannels == 1 && !expand ? GL_LUMINANCE : GL_RGBA;
+	const size_t texelSize = format == GL_RGBA ? 4 : 1;
+	if (expand && vol3dTransferDirty) {
+		vol3dTransferDirty = false;
+		vol3dDirtyMin = 0;
+		vol3dDirtyMax = vol3dSizeZ;
+	}
+
+	if (vol3dTexId == 0 || vol3dTexFormat != format || vol3dTexSizeX != vol3dSizeX || vol3dTexSizeY != vol3dSizeY || vol3dTexSizeZ != vol3dSizeZ) {
+		// allocate the storage only when the size changes, the content is uploaded below
+		if (vol3dTexId != 0) {
+			this->glDeleteTextures(1, &vol3dTexId);
+		}
+		this->glGenTextures(1, &vol3dTexId);
+		this->glBindTexture(GL_TEXTURE_3D, vol3dTexId);
+		this->glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+		this->glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		this->glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		this->glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
+		this->glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		this->glTexImage3D(GL_TEXTURE_3D, 0, format == GL_RGBA ? GL_RGBA8 : GL_LUMINANCE8, vol3dSizeX, vol3dSizeY, vol3dSizeZ, 0, format, GL_UNSIGNED_BYTE, nullptr);
+
+		// the scalar textures have the coarser levels, selected by the level of detail of the frame
+		vol3dTexLevels = format == GL_LUMINANCE ? MaxDetail : 0;
+		for (int level = 1; level <= vol3dTexLevels; ++level) {
+			vol3dLevels[level - 1].resize(max(vol3dSizeX >> level, (size_t) 1) * max(vol3dSizeY >> level, (size_t) 1) * max(vol3dSizeZ >> level, (size_t) 1));
+			this->glTexImage3D(GL_TEXTURE_3D, level, GL_LUMINANCE8, max(vol3dSizeX >> level, (size_t) 1), max(vol3dSizeY >> level, (size_t) 1), max(vol3dSizeZ >> level, (size_t) 1), 0, format, GL_UNSIGNED_BYTE, nullptr);
+		}
+		for (int level = vol3dTexLevels; level < MaxDetail; ++level) {
+			vector<unsigned char>().swap(vol3dLevels[level]);
+		}
+		this->glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, vol3dTexLevels);
+		this->glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, vol3dTexLevels > 0 ? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR);
+		vol3dTexFormat = format;
+		vol3dTexSizeX = vol3dSizeX;
+		vol3dTexSizeY = vol3dSizeY;
+		vol3dTexSizeZ = vol3dSizeZ;
+		vol3dDirtyMin = 0;
+		vol3dDirtyMax = vol3dSizeZ;
+	}
+	else {
+		this->glBindTexture(GL_TEXTURE_3D, vol3dTexId);
+	}
+
+	// stream slabs of about 4 MB, the storage of the pixel buffer is orphaned before each slab,
+	// so the driver does not have to wait for the copy of the previous one
+	const size_t sliceSize = vol3dSizeX * vol3dSizeY * texelSize;
+	const size_t slabSlices = max((size_t) 1, (size_t) (4 << 20) / sliceSize);
+	unique_ptr<PoolBuffer<unsigned char>> temp;
+	if (pixelBuffers && vol3dPboId == 0) {
+		this->glGenBuffers(1, &vol3dPboId);
+	}
+	this->glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (size_t z = vol3dDirtyMin; z < vol3dDirtyMax; z += slabSlices) {
+		const size_t slices = min(slabSlices, vol3dDirtyMax - z);
+		void *mapped = nullptr;
+		if (pixelBuffers) {
+			this->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, vol3dPboId);
+			this->glBufferData(GL_PIXEL_UNPACK_BUFFER, slices * sliceSize, nullptr, GL_STREAM_DRAW);
+			mapped = this->glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+		}
+
+		const void *pixels = nullptr;
+		if (mapped != nullptr) {
+			copySlices((unsigned char *) mapped, z, slices, expand);
+			this->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		else {
+			// upload the rest from the client memory
+			if (pixelBuffers) {
+				this->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				pixelBuffers = false;
+			}
+			if (expand) {
+				if (temp == nullptr) {
+					temp.reset(new PoolBuffer<unsigned char>(slabSlices * sliceSize));
+				}
+				copySlices(temp->data(), z, slices, expand);
+				pixels = temp->data();
+			}
+			else {
+				pixels = vol3dData + z * sliceSize;
+			}
+		}
+		this->glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, z, vol3dSizeX, vol3dSizeY, slices, format, GL_UNSIGNED_BYTE, pixels);
+	}
+	if (pixelBuffers) {
+		this->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	uploadLevels(vol3dDirtyMin, vol3dDirtyMax);
+	this->glBindTexture(GL_TEXTURE_3D, 0);
+	vol3dDirtyMin = vol3dDirtyMax = 0;
+}
+
+/**
+ * Compute and upload the modified slices of the coarser levels, each voxel is the average
+ * of the 2x2x2 voxels of the previous level, the last ones are repeated if the size is odd.
+ */
+void VolumeRenderer::uploadLevels(size_t zmin, size_t zmax) {
+	const unsigned char *src = vol3dData;
+	size_t sx = vol3dSizeX, sy = vol3dSizeY, sz = vol3dSizeZ;
+	for (int level = 1; level <= vol3dTexLevels && zmin < zmax; ++level) {
+		const size_t dx = max(sx / 2, (size_t) 1);
+		const size_t dy = max(sy / 2, (size_t) 1);
+		const size_t dz = max(sz / 2, (size_t) 1);
+		zmin = min(zmin / 2, dz);
+		zmax = min((zmax + 1) / 2, dz);
+
+		unsigned char *dst = vol3dLevels[level - 1].data();
+		parallelFor(zmin, zmax, [&](int begin, int end) {
+			for (size_t z = begin; z < (size_t) end; ++z) {
+				const unsigned char *z0 = src + min(2 * z, sz - 1) * sx * sy;
+				const unsigned char *z1 = src + min(2 * z + 1, sz - 1) * sx * sy;
+				for (size_t y = 0; y < dy; ++y) {
+					const size_t y0 = min(2 * y, sy - 1) * sx;
+					const size_t y1 = min(2 * y + 1, sy - 1) * sx;
+					unsigned char *row = dst + (z * dy + y) * dx;
+					for (size_t x = 0; x < dx; ++x) {
+						const size_t x0 = min(2 * x, sx - 1);
+						const size_t x1 = min(2 * x + 1, sx - 1);
+						unsigned sum = z0[y0 + x0] + z0[y0 + x1] + z0[y1 + x0] + z0[y1 + x1]
+							+ z1[y0 + x0] + z1[y0 + x1] + z1[y1 + x0] + z1[y1 + x1];
+						row[x] = (sum + 4) / 8;
+					}
+				}
+			}
+		});
+		this->glTexSubImage3D(GL_TEXTURE_3D, level, 0, 0, zmin, dx, dy, zmax - zmin, GL_LUMINANCE, GL_UNSIGNED_BYTE, dst + zmin * dx * dy);
+
+		src = dst;
+		sx = dx;
+		sy = dy;
+		sz = dz;
+	}
+}
+
+/**
+ * Choose the level of detail of the interactive frames from the time of the last one,
+ * each level draws half of the slices from a texture with an eighth of the voxels.
+ */
+void VolumeRenderer::adaptDetail() {
+	if (vol3dFrameTime > frameTarget && detail < MaxDetail) {
+		interactiveDetail = detail + 1;
+	}
+	else if (vol3dFrameTime < frameTarget / 3 && detail > 0) {
+		interactiveDetail = detail - 1;
+	}
+}
+
+void VolumeRenderer::copySlices(unsigned char *dst, size_t z, size_t slices, bool expand) const {
+	const size_t count = vol3dSizeX * vol3dSizeY * slices;
+	const unsigned char *src = vol3dData + z * vol3dSizeX * vol3dSizeY * vol3dChannels;
+	if (!expand) {
+		memcpy(dst, src, count * vol3dChannels);
+		return;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		memcpy(dst + 4 * i, vol3dTransfer[src[i]], 4);
+	}
+}
+
+void VolumeRenderer::uploadTransfer() {
+	if (vol3dTfId == 0) {
+		this->glGenTextures(1, &vol3dTfId);
+		this->glBindTexture(GL_TEXTURE_1D, vol3dTfId);
+		this->glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		this->glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		this->glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	}
+	else {
+		this->glBindTexture(GL_TEXTURE_1D, vol3dTfId);
+	}
+	this->glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA8, 256, 0, GL_RGBA, GL_UNSIGNED_BYTE, vol3dTransfer);
+	this->glBindTexture(GL_TEXTURE_1D, 0);
+	vol3dTransferDirty = false;
+}
+
+void VolumeRenderer::allocateData(size_t width, size_t height, size_t depth, int channels) {
+	if (width != vol3dSizeX || height != vol3dSizeY || depth != vol3dSizeZ || channels != vol3dChannels) {
+		delete []vol3dData;
+		vol3dSizeX = width;
+		vol3dSizeY = height;
+		vol3dSizeZ = depth;
+		vol3dChannels = channels;
+		vol3dData = new unsigned char[vol3dSizeX * vol3dSizeY * vol3dSizeZ * channels];
+	}
+	delete vol3dSource;
+	vol3dSource = nullptr;
+	vol3dDirtyMin = 0;
+	vol3dDirtyMax = depth;
+}
+
+void VolumeRenderer::invalidate() {
+	delete vol3dSource;
+	vol3dSource = nullptr;
+}
+
+void VolumeRenderer::updateTransfer() {
+	int threshold = this->threshold;
+	int alpha = this->alpha;
+	bool clr = false;
+
+	if (threshold < 0) {
+		threshold = -threshold;
+		clr = true;
+	}
+	if (threshold > 255) {
+		threshold = 255;
+	}
+
+	if (alpha < 0) {
+		alpha = -alpha;
+		clr = true;
+	}
+	if (alpha > 255) {
+		alpha = 255;
+	}
+
+	// the same mapping as the conversion of the voxels into rgba
+	unsigned char transfer[256][4];
+	for (int value = 0; value < 256; ++value) {
+		unsigned char *color = transfer[value];
+		if (value + 1 > threshold) {
+			color[0] = lut[value];
+			color[1] = lut[value];
+			color[2] = lut[value];
+			color[3] = value * alpha >> 8;
+		}
+		else if (!clr) {
+			color[0] = color[1] = color[2] = color[3] = 0;
+		}
+		else {
+			color[0] = color[1] = color[2] = value;
+			color[3] = 0;
+		}
+	}
+	if (memcmp(transfer, vol3dTransfer, sizeof(transfer)) != 0) {
+		memcpy(vol3dTransfer, transfer, sizeof(transfer));
+		vol3dTransferDirty = true;
+	}
+}
+
+void VolumeRenderer::setVolume(const Volume<float1> &volume, float sphere[4]) {
+	if (volume.depth() == 1) {
+		Volume<float1> temp(volume.width(), volume.height(), 2);
+		volume.resize(temp, ResizeNearest);
+		setVolume(temp, sphere);
+		return;
+	}
+
+	if (sphere != nullptr && glContext != nullptr && vol3dShader == nullptr) {
+		// the highlight is drawn by the shader, without it the volume is converted into rgba
+		setVolume<float1>(volume, sphere);
+		return;
+	}
+
+	TraceScope trace("render.scalar");
+	const double started = FrameProfile::now();
+	if (vol3dSource == nullptr || volume.width() != vol3dSizeX || volume.height() != vol3dSizeY || volume.depth() != vol3dSizeZ || vol3dChannels != 1) {
+		allocateData(volume.width(), volume.height(), volume.depth(), 1);
+		vol3dDirtyMax = 0;
+	}
+
+	// convert the bricks modified since the last update, the writers copy the shared bricks first
+	vector<unsigned> modified;
+	for (unsigned brick = 0; brick < volume.brickCount(); ++brick) {
+		if (vol3dSource == nullptr || !volume.sharesBrick(*vol3dSource, brick)) {
+			modified.push_back(brick);
+		}
+	}
+	const size_t sliceSize = vol3dSizeX * vol3dSizeY;
+	parallelFor(0, (int) modified.size(), [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			const int zmin = volume.brickSlice(modified[i]);
+			const int zmax = zmin + volume.brickDepth(modified[i]);
+			for (int z = zmin; z < zmax; ++z) {
+				const float1 *src = volume.slice(z);
+				unsigned char *dst = vol3dData + z * sliceSize;
+				for (size_t j = 0; j < sliceSize; ++j) {
+					dst[j] = toByte(src[j].value);
+				}
+			}
+		}
+	});
+	if (!modified.empty()) {
+		const size_t zmin = volume.brickSlice(modified.front());
+		const size_t zmax = volume.brickSlice(modified.back()) + volume.brickDepth(modified.back());
+		vol3dDirtyMin = vol3dDirtyMin < vol3dDirtyMax ? min(vol3dDirtyMin, zmin) : zmin;
+		vol3dDirtyMax = max(vol3dDirtyMax, zmax);
+		trace.addVoxels((double) (zmax - zmin) * sliceSize);
+	}
+	delete vol3dSource;
+	vol3dSource = new Volume<float1>(volume);
+
+	updateTransfer();
+	if (sphere != nullptr) {
+		vol3dSphere[0] = sphere[0] * volume.width();
+		vol3dSphere[1] = sphere[1] * volume.height();
+		vol3dSphere[2] = sphere[2] * volume.depth();
+		vol3dSphere[3] = sphere[3] * volume.depth();
+	}
+	else {
+		vol3dSphere[3] = -1;
+	}
+	frames.add(FrameProfile::Convert, FrameProfile::now() - started);
+	requestRender(ModelChanged);
+}
+
+void VolumeRenderer::renderFrames(QSurface *surface) {
+	const FrameProfile::Stage stages[] = {
+		FrameProfile::Frame, FrameProfile::Draw, FrameProfile::Swap,
+		FrameProfile::Build, FrameProfile::Upload, FrameProfile::Convert
+	};
+
+	// the painter uses its own viewport and resets the state of the blending
+	GLint viewport[4];
+	this->glGetIntegerv(GL_VIEWPORT, viewport);
+	{
+		QOpenGLPaintDevice device(surface->size());
+		QPainter painter(&device);
+		QFont font("monospace");
+		font.setStyleHint(QFont::TypeWriter);
+		painter.setFont(font);
+
+		const int lineHeight = painter.fontMetrics().height();
+		const QRect box(8, 8, 36 * painter.fontMetrics().averageCharWidth(), lineHeight * 7 + 8);
+		painter.fillRect(box, QColor(0, 0, 0, 160));
+		painter.setPen(Qt::white);
+
+		int y = box.top() + 4 + painter.fontMetrics().ascent();
+		painter.drawText(box.left() + 4, y, "stage       p50     p95     p99 ms");
+		for (FrameProfile::Stage stage : stages) {
+			FrameProfile::Percentiles time = frames.percentiles(stage);
+			y += lineHeight;
+			painter.drawText(box.left() + 4, y, QString::asprintf("%-8s%7.2f %7.2f %7.2f",
+				FrameProfile::name(stage), time.p50, time.p95, time.p99));
+		}
+	}
+	initializeOpenGL();
+	this->glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
 }
 
 void VolumeRenderer::reset() {
@@ -155,8 +671,10 @@ void VolumeRenderer::adjust(float brightness, float contrast, float gamma) {
 	}
 }
 
-void VolumeRenderer::renderGl(const QRect *roi, float readPixels[4]) {
-	QSurface *surface = getSurface();
+/**
+ * Make the context current on the surface, it is created with the format of the first surface.
+ */
+bool VolumeRenderer::makeContextCurrent(QSurface *surface) {
 	bool needsInitialize = false;
 
 	if (glContext == nullptr) {
@@ -166,11 +684,34 @@ void VolumeRenderer::renderGl(const QRect *roi, float readPixels[4]) {
 		needsInitialize = true;
 	}
 
-	glContext->makeCurrent(surface);
+	if (!glContext->makeCurrent(surface)) {
+		return false;
+	}
 
 	if (needsInitialize) {
 		initializeOpenGLFunctions();
 		initializeOpenGL();
+		pixelBuffers = glContext->format().version() >= qMakePair(2, 1)
+			|| glContext->hasExtension("GL_ARB_pixel_buffer_object");
+
+		vol3dShader = new QOpenGLShaderProgram();
+		if (!vol3dShader->addShaderFromSourceCode(QOpenGLShader::Vertex, VERTEX_SHADER)
+			|| !vol3dShader->addShaderFromSourceCode(QOpenGLShader::Fragment, FRAGMENT_SHADER)
+			|| !vol3dShader->link()) {
+			// the scalar volumes are colored while uploading
+			qWarning() << "failed to build the volume shader:" << vol3dShader->log();
+			delete vol3dShader;
+			vol3dShader = nullptr;
+		}
+	}
+	return true;
+}
+
+void VolumeRenderer::renderGl(const QRect *roi, float readPixels[4]) {
+	QSurface *surface = getSurface();
+	const double started = FrameProfile::now();
+	if (!makeContextCurrent(surface)) {
+		return;
 	}
 
 	VolumeRenderer::renderModel(surface, roi);
@@ -181,6 +722,68 @@ void VolumeRenderer::renderGl(const QRect *roi, float readPixels[4]) {
 		this->glReadPixels(x, y, 1, 1, GL_RGBA, GL_FLOAT, readPixels);
 	}
 	else {
+		if (showFrames) {
+			renderFrames(surface);
+		}
+		const double swap = FrameProfile::now();
 		glContext->swapBuffers(surface);
+		frames.add(FrameProfile::Swap, FrameProfile::now() - swap);
+		frames.add(FrameProfile::Frame, FrameProfile::now() - started);
+		vol3dFrameTime = FrameProfile::now() - vol3dFrameStarted;
 	}
 }
+
+bool VolumeRenderer::renderTurntable(const QString &path, int width, int height, int count, float degrees) {
+	TraceScope trace("render.turntable", (double) width * height * count);
+	QOffscreenSurface surface;
+	surface.setFormat(glContext != nullptr ? glContext->format() : QSurfaceFormat::defaultFormat());
+	surface.create();
+	if (!surface.isValid() || !makeContextCurrent(&surface)) {
+		qWarning() << "failed to create the offscreen surface";
+		return false;
+	}
+
+	QOpenGLFramebufferObject fbo(width, height, QOpenGLFramebufferObject::CombinedDepthStencil);
+	if (!fbo.isValid() || !fbo.bind()) {
+		qWarning() << "failed to create the framebuffer:" << width << "x" << height;
+		return false;
+	}
+
+	// the frames are drawn at full detail, the view is restored at the end
+	const matrix3d transform = this->vol3dTransform;
+	const int detail = this->detail;
+	this->detail = 0;
+
+	const QRect roi(0, 0, width, height);
+	const int digits = max(4, (int) QString::number(count - 1).size());
+	vector<QImage> images(parallelThreadCount());
+	atomic<int> failed(0);
+	for (int first = 0; first < count && failed == 0; first += images.size()) {
+		const int batch = min((int) images.size(), count - first);
+		for (int i = 0; i < batch; ++i) {
+			this->vol3dTransform = transform;
+			this->vol3dTransform *= rotation(deg2rad(degrees * (first + i) / count), vector3d(0, 1, 0));
+			_resetView = true;
+			renderModel(&surface, &roi);
+			images[i] = fbo.toImage();
+		}
+
+		// encoding the images takes longer than drawing them
+		parallelFor(0, batch, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				QString file = path.arg(first + i, digits, 10, QChar('0'));
+				if (!images[i].save(file, "PNG")) {
+					qWarning() << "failed to save:" << file;
+					failed += 1;
+				}
+			}
+		});
+	}
+
+	fbo.release();
+	this->vol3dTransform = transform;
+	this->detail = detail;
+	_resetView = true;
+	requestRender(ViewChanged);
+	return failed == 0;
+}
@@ -2,26 +2,79 @@
 #define VOLUME_RENDERER_H
 
 #include "voxel.h"
+#include "voxel_float1.h"
 #include "volume.h"
+#include "volume_occupancy.h"
 #include "math3d.h"
+#include "frame_profile.h"
 
 #include <QRgb>
 #include <QOpenGLFunctions_2_0>
+#include <QOpenGLShaderProgram>
 
 class VolumeRenderer: protected QOpenGLFunctions_2_0 {
+	// number of the coarser levels of detail
+	enum { MaxDetail = 3 };
 
 	QOpenGLContext *glContext;
 	GLuint vol3dTexId;
-	GLuint vol3dListId;
+	GLuint vol3dPboId;
+
+	// the slices of the volume as polygons: texture coordinates and vertices, interleaved
+	vector<GLfloat> vol3dSlices;
+	vector<GLint> vol3dSliceFirst;
+	vector<GLsizei> vol3dSliceCount;
+	float vol3dSpacing;     // distance of the slices in voxels
+
+	// size of the storage of the texture, kept while the size of the volume does not change
+	size_t vol3dTexSizeX;
+	size_t vol3dTexSizeY;
+	size_t vol3dTexSizeZ;
+
+	// the scalar volumes are uploaded as luminance and colored by the transfer function in the shader
+	QOpenGLShaderProgram *vol3dShader;
+	GLenum vol3dTexFormat;
+	GLuint vol3dTfId;
 
 	unsigned char *vol3dData;
+	int vol3dChannels;      // bytes per voxel: 1 for scalar volumes, 4 for rgba
 	size_t vol3dSizeX;
 	size_t vol3dSizeY;
 	size_t vol3dSizeZ;
 
+	// slices of the data not yet uploaded into the texture
+	size_t vol3dDirtyMin;
+	size_t vol3dDirtyMax;
+
+	// the coarser levels of the scalar texture, each halves the size of the previous one
+	vector<unsigned char> vol3dLevels[MaxDetail];
+	int vol3dTexLevels;
+
+	// time of the slices of the last frame, from building them to the swap, in milliseconds
+	double vol3dFrameStarted;
+	double vol3dFrameTime;
+
+	// the last converted scalar volume, sharing its bricks: the bricks not shared with the next one were modified
+	Volume<float1> *vol3dSource;
+
+	// color of each value of the scalar volumes, computed from the lut, threshold and alpha
+	unsigned char vol3dTransfer[256][4];
+	bool vol3dTransferDirty;
+
+	// highlighted sphere of the scalar volumes in voxels, the radius is negative if there is none
+	float vol3dSphere[4];
+
 	// brightness, contrast, gamma, threshold
 	unsigned char lut[256];
 
+	void allocateData(size_t width, size_t height, size_t depth, int channels);
+	void updateTransfer();
+	void copySlices(unsigned char *dst, size_t z, size_t slices, bool expand) const;
+	void uploadLevels(size_t zmin, size_t zmax);
+	matrix3d textureMatrix() const;
+	bool pickRay(float x, float y, vector3d &front, vector3d &back);
+	void buildSlices(const matrix3d &texture);
+
 protected:
 	enum RenderRequestCause {
 		ModelChanged,   // update volume texture
@@ -43,7 +96,32 @@ protected:
 	int threshold = 0;
 	int alpha = 256;
 
+	// slices per voxel at full detail
+	float sampling = 1;
+
+	/**
+	 * Level of detail of the next frame: the slices and the texture are reduced by 2^detail.
+	 * While the view changes the frames are drawn at the interactive level, chosen to draw
+	 * a frame in about `frameTarget` milliseconds, then the detail is refined until it is 0.
+	 */
+	int detail = 0;
+	int interactiveDetail = 0;
+	float frameTarget = 40;
+
+	void adaptDetail();
+
+	// timings of the rendering stages, optionally drawn over the volume
+	FrameProfile frames;
+	bool showFrames = false;
+
+	// upload the texture through pixel buffers in slabs, if supported by the context
+	bool pixelBuffers = false;
+
 	virtual void renderModel(QSurface *surface, const QRect *roi);
+	void uploadTexture();
+	void uploadTransfer();
+	void renderFrames(QSurface *surface);
+	bool makeContextCurrent(QSurface *surface);
 	virtual void requestRender(RenderRequestCause cause) = 0;
 	virtual QSurface* getSurface() = 0;
 
@@ -51,14 +129,40 @@ public:
 	void initializeOpenGL();
 	void renderGl(const QRect *roi, float readPixels[4] = nullptr);
 
+	/**
+	 * Render `count` views turning by `degrees` around the vertical axis of the current view, offscreen,
+	 * into the png files named by `path` with "%1" replaced by the frame number.
+	 * The frames are drawn one after the other with the context of the renderer, they are saved in parallel.
+	 */
+	bool renderTurntable(const QString &path, int width, int height, int count, float degrees = 360);
+
 	void reset();
 	void adjust(float brightness, float contrast, float gamma);
 
+	// convert the whole scalar volume again on the next update, even if its bricks did not change
+	void invalidate();
+
 	VolumeRenderer() {
 		glContext = nullptr;
 		vol3dTexId = 0;
-		vol3dListId = 0;
+		vol3dPboId = 0;
+		vol3dSpacing = 1;
+		vol3dTexSizeX = 0;
+		vol3dTexSizeY = 0;
+		vol3dTexSizeZ = 0;
+		vol3dShader = nullptr;
+		vol3dTexFormat = GL_RGBA;
+		vol3dTfId = 0;
 		vol3dData = nullptr;
+		vol3dChannels = 4;
+		vol3dDirtyMin = 0;
+		vol3dDirtyMax = 0;
+		vol3dTexLevels = 0;
+		vol3dFrameStarted = 0;
+		vol3dFrameTime = 0;
+		vol3dSource = nullptr;
+		vol3dTransferDirty = true;
+		vol3dSphere[3] = -1;
 		vol3dSizeX = 0;
 		vol3dSizeY = 0;
 		vol3dSizeZ = 0;
@@ -74,24 +178,25 @@ public:
 	}
 	~VolumeRenderer() override;
 
+	/**
+	 * Update the texture with the scalar volume, only the modified bricks are converted and uploaded.
+	 * Changing the threshold, alpha or lut updates only the transfer function.
+	 */
+	void setVolume(const Volume<float1> &volume, float sphere[4]);
+
 	template<typename voxel>
 	void setVolume(const Volume<voxel> &volume, float sphere[4]) {
 		const Volume<voxel> *vol = &volume;
 		if (volume.depth() == 1) {
 			Volume<voxel> *temp = new Volume<voxel>(volume.width(), volume.height(), 2);
-			volume.resize(*temp, 0);
+			volume.resize(*temp, ResizeNearest);
 			vol = temp;
 		}
+		TraceScope trace("render.rgba", (double) vol->width() * vol->height() * vol->depth());
+		const double started = FrameProfile::now();
+		allocateData(vol->width(), vol->height(), vol->depth(), 4);
 		unsigned char *buffer = vol3dData;
 
-		if (vol->width() != vol3dSizeX || vol->height() != vol3dSizeY || vol->depth() != vol3dSizeZ) {
-			delete []vol3dData;
-			vol3dSizeX = vol->width();
-			vol3dSizeY = vol->height();
-			vol3dSizeZ = vol->depth();
-			vol3dData = buffer = new unsigned char[vol3dSizeX * vol3dSizeY * vol3dSizeZ * 4];
-		}
-
 		int threshold = this->threshold;
 		int alpha = this->alpha;
 		bool clr = false;
@@ -122,6 +227,7 @@ public:
 
 			for (unsigned z = 0; z < vol3dSizeZ; ++z) {
 				for (unsigned y = 0; y < vol3dSizeY; ++y) {
+					const voxel *row = vol->row(y, z);
 					for (unsigned x = 0; x < vol3dSizeX; ++x) {
 						vector3d pos(x, y, z, 0);
 						float d = length(pos - cut);
@@ -132,7 +238,7 @@ public:
 							buffer[3] = qAlpha(highlightColor);
 						}
 						else {
-							int vox = vol->get(x, y, z).toRGBA(buffer);
+							int vox = row[x].toRGBA(buffer);
 							if (vox > threshold) {
 								buffer[0] = lut[buffer[0]];
 								buffer[1] = lut[buffer[1]];
@@ -154,8 +260,9 @@ public:
 		else {
 			for (unsigned z = 0; z < vol3dSizeZ; ++z) {
 				for (unsigned y = 0; y < vol3dSizeY; ++y) {
+					const voxel *row = vol->row(y, z);
 					for (unsigned x = 0; x < vol3dSizeX; ++x) {
-						int vox = vol->get(x, y, z).toRGBA(buffer);
+						int vox = row[x].toRGBA(buffer);
 						if (vox > threshold) {
 							buffer[0] = lut[buffer[0]];
 							buffer[1] = lut[buffer[1]];
@@ -177,11 +284,48 @@ public:
 		if (vol != &volume) {
 			delete vol;
 		}
+		frames.add(FrameProfile::Convert, FrameProfile::now() - started);
 		requestRender(ModelChanged);
 	}
 
+	/**
+	 * Find the first voxel above the threshold seen at the point (x, y) of the surface, in the current view,
+	 * walking the ray through the occupancy of the volume. The point where the ray enters the voxel is
+	 * returned in `result`, the coordinates are from 0 to 1 like the texture coordinates.
+	 */
+	template<typename voxel>
+	bool pick(const Volume<voxel> &volume, const VolumeOccupancy<voxel> &occupancy, float x, float y, float result[3]) {
+		vector3d front, back;
+		if (!pickRay(x, y, front, back)) {
+			return false;
+		}
+		int threshold = this->threshold;
+		if (threshold < 0) {
+			threshold = -threshold;
+		}
+		if (threshold > 255) {
+			threshold = 255;
+		}
+
+		const float size[3] = {(float) volume.width(), (float) volume.height(), (float) volume.depth()};
+		const float from[3] = {front.x * size[0], front.y * size[1], front.z * size[2]};
+		const float to[3] = {back.x * size[0], back.y * size[1], back.z * size[2]};
+		const auto visible = [threshold](const voxel &value) {
+			byte rgba[4];
+			return value.toRGBA(rgba) > threshold;
+		};
+		if (!occupancy.raycast(volume, from, to, visible, result)) {
+			return false;
+		}
+		for (int a = 0; a < 3; ++a) {
+			result[a] /= size[a];
+		}
+		return true;
+	}
+
 	template<typename voxel>
 	void setPositions(const Volume<voxel> &volume) {
+		const double started = FrameProfile::now();
 		int threshold = this->threshold;
 		if (threshold < 0) {
 			threshold = -threshold;
@@ -190,20 +334,14 @@ public:
 			threshold = 255;
 		}
 
+		allocateData(volume.width(), volume.height(), volume.depth(), 4);
 		unsigned char *buffer = vol3dData;
-		if (volume.width() != vol3dSizeX || volume.height() != vol3dSizeY || volume.depth() != vol3dSizeZ) {
-			delete []vol3dData;
-			vol3dSizeX = volume.width();
-			vol3dSizeY = volume.height();
-			vol3dSizeZ = volume.depth();
-			vol3dData = buffer = new unsigned char[vol3dSizeX * vol3dSizeY * vol3dSizeZ * 4];
-		}
 
 		for (unsigned z = 0; z < vol3dSizeZ; ++z) {
 			for (unsigned y = 0; y < vol3dSizeY; ++y) {
+				const voxel *row = volume.row(y, z);
 				for (unsigned x = 0; x < vol3dSizeX; ++x) {
-					voxel vox = volume.get(x, y, z);
-					if (vox.toRGBA(buffer) > threshold) {
+					if (row[x].toRGBA(buffer) > threshold) {
 						buffer[0] = toByte(x / static_cast<float>(vol3dSizeX));
 						buffer[1] = toByte(y / static_cast<float>(vol3dSizeY));
 						buffer[2] = toByte(z / static_cast<float>(vol3dSizeZ));
@@ -222,6 +360,7 @@ public:
 				}
 			}
 		}
+		frames.add(FrameProfile::Convert, FrameProfile::now() - started);
 		requestRender(ModelChanged);
 	}
 };
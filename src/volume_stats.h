@@ -0,0 +1,216 @@
+#ifndef VOLUME_STATS_H
+#define VOLUME_STATS_H
+
+#include "volume.h"
+#include "voxel_float1.h"
+
+#include <cfloat>
+
+/**
+ * Range and moments of the values of a scalar volume.
+ */
+struct VolumeStats {
+	float min = +FLT_MAX;
+	float max = -FLT_MAX;
+	double sum = 0;
+	double sum2 = 0;
+	size_t count = 0;
+
+	double mean() const {
+		return count > 0 ? sum / count : 0;
+	}
+	double variance() const {
+		if (count == 0) {
+			return 0;
+		}
+		double mean = sum / count;
+		double result = sum2 / count - mean * mean;
+		return result > 0 ? result : 0;
+	}
+	double stddev() const {
+		return sqrt(variance());
+	}
+
+	/// accumulate count values, the sums are kept in double precision as a whole brick may be added at once
+	void add(const float1 *values, size_t count) {
+		float min = this->min;
+		float max = this->max;
+		double sum = 0;
+		double sum2 = 0;
+		for (size_t i = 0; i < count; ++i) {
+			double value = values[i].value;
+			min = values[i].value < min ? values[i].value : min;
+			max = values[i].value > max ? values[i].value : max;
+			sum += value;
+			sum2 += value * value;
+		}
+		this->min = min;
+		this->max = max;
+		this->sum += sum;
+		this->sum2 += sum2;
+		this->count += count;
+	}
+
+	void merge(const VolumeStats &other) {
+		min = other.min < min ? other.min : min;
+		max = other.max > max ? other.max : max;
+		sum += other.sum;
+		sum2 += other.sum2;
+		count += other.count;
+	}
+};
+
+/**
+ * Compute the statistics of the volume, the slices are reduced in parallel, then merged in order,
+ * so the result does not depend on the number of threads.
+ */
+static inline VolumeStats volumeStats(const Volume<float1> &volume) {
+	const int width = volume.width();
+	const int height = volume.height();
+	vector<VolumeStats> slices(volume.depth());
+	parallelFor(0, volume.depth(), [&](int begin, int end) {
+		for (int z = begin; z < end; ++z) {
+			for (int y = 0; y < height; ++y) {
+				slices[z].add(volume.row(y, z), width);
+			}
+		}
+	});
+
+	VolumeStats result;
+	for (const VolumeStats &slice : slices) {
+		result.merge(slice);
+	}
+	return result;
+}
+
+/**
+ * Scale the values of the volume into the range [0, 1] in a single parallel pass.
+ * With `useAbs` the values are divided by the range and the absolute value is kept.
+ */
+static inline void normalize(Volume<float1> &volume, const VolumeStats &stats, bool useAbs = false) {
+	const int width = volume.width();
+	const int height = volume.height();
+	const float offset = useAbs ? 0 : stats.min;
+	const float scale = stats.max > stats.min ? 1 / (stats.max - stats.min) : 0;
+
+	volume.detach();
+	parallelFor(0, volume.depth(), [&](int begin, int end) {
+		for (int z = begin; z < end; ++z) {
+			for (int y = 0; y < height; ++y) {
+				float1 *row = volume.row(y, z);
+				for (int x = 0; x < width; ++x) {
+					float value = (row[x].value - offset) * scale;
+					row[x].value = useAbs ? abs(value) : value;
+				}
+			}
+		}
+	});
+}
+
+static inline VolumeStats normalize(Volume<float1> &volume, bool useAbs = false) {
+	VolumeStats stats = volumeStats(volume);
+	normalize(volume, stats, useAbs);
+	return stats;
+}
+
+/**
+ * Statistics and histogram of a volume, updated incrementally.
+ * A copy of the volume is kept, sharing the bricks, only the bricks which are not shared anymore are scanned again.
+ * The histogram covers the range [0, 1], values outside of it are counted in the first and last bins.
+ */
+class VolumeStatistics {
+public:
+	enum { Bins = 4096 };
+
+private:
+	struct Brick {
+		VolumeStats stats;
+		vector<size_t> histogram;
+	};
+
+	unique_ptr<Volume<float1>> snapshot;
+	vector<Brick> bricks;
+	VolumeStats total;
+	vector<size_t> counts;
+
+public:
+	/**
+	 * Update the statistics to match the volume, returns the number of bricks scanned.
+	 */
+	unsigned update(const Volume<float1> &volume) {
+		vector<unsigned> dirty;
+		if (snapshot == nullptr || snapshot->width() != volume.width() || snapshot->height() != volume.height() || snapshot->depth() != volume.depth()) {
+			bricks.assign(volume.brickCount(), Brick());
+			for (unsigned brick = 0; brick < volume.brickCount(); ++brick) {
+				dirty.push_back(brick);
+			}
+		}
+		else {
+			for (unsigned brick = 0; brick < volume.brickCount(); ++brick) {
+				if (!volume.sharesBrick(*snapshot, brick)) {
+					dirty.push_back(brick);
+				}
+			}
+		}
+		if (snapshot != nullptr && dirty.empty()) {
+			return 0;
+		}
+
+		const size_t sliceSize = (size_t) volume.width() * volume.height();
+		parallelFor(0, dirty.size(), [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				unsigned index = dirty[i];
+				Brick &brick = bricks[index];
+				const float1 *data = volume.slice(volume.brickSlice(index));
+				const size_t count = sliceSize * volume.brickDepth(index);
+
+				brick.stats = VolumeStats();
+				brick.stats.add(data, count);
+				brick.histogram.assign(Bins, 0);
+				for (size_t n = 0; n < count; ++n) {
+					int bin = data[n].value * Bins;
+					brick.histogram[bin < 0 ? 0 : bin >= Bins ? Bins - 1 : bin] += 1;
+				}
+			}
+		});
+
+		total = VolumeStats();
+		counts.assign(Bins, 0);
+		for (const Brick &brick : bricks) {
+			total.merge(brick.stats);
+			for (int bin = 0; bin < Bins; ++bin) {
+				counts[bin] += brick.histogram[bin];
+			}
+		}
+		snapshot.reset(new Volume<float1>(volume));
+		return dirty.size();
+	}
+
+	const VolumeStats &stats() const {
+		return total;
+	}
+
+	// histogram of the values with the given number of bins
+	vector<size_t> histogram(int bins) const {
+		vector<size_t> result(bins > 0 ? bins : 1, 0);
+		for (int bin = 0; bin < (int) counts.size(); ++bin) {
+			result[(size_t) bin * result.size() / Bins] += counts[bin];
+		}
+		return result;
+	}
+
+	// the value below which the given fraction of the values fall, with the precision of the histogram
+	float percentile(float fraction) const {
+		size_t rank = fraction * total.count;
+		size_t seen = 0;
+		for (int bin = 0; bin < (int) counts.size(); ++bin) {
+			seen += counts[bin];
+			if (seen > rank) {
+				return (bin + .5f) / Bins;
+			}
+		}
+		return 1;
+	}
+};
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef VOLUME_TRACE_H
+#define VOLUME_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "volume_pool.h"
+
+using namespace std;
+
+/**
+ * Timed phases of the operations kept in a bounded buffer, the oldest events are overwritten.
+ * The events can be exported in the chrome trace event format (chrome://tracing, ui.perfetto.dev)
+ * or summarized by name. Recording is enabled at runtime, while disabled the scopes only check a flag.
+ */
+class VolumeTrace {
+public:
+	struct Event {
+		string name;
+		int64_t start;          // microseconds since the trace was created
+		int64_t duration;       // microseconds
+		unsigned thread;
+		double voxels;          // voxels processed, 0 if not known
+		double busy;            // time spent by the threads of the parallel loops, in microseconds
+		double capacity;        // duration of the parallel loops multiplied with their thread count
+		size_t memory;          // bytes of volume buffers in use at the end of the event
+		size_t peak;            // peak bytes of volume buffers in use during the event, 0 if not tracked
+	};
+
+	struct Summary {
+		string name;
+		size_t count = 0;
+		double total = 0;       // milliseconds
+		double max = 0;         // milliseconds
+		double voxels = 0;
+		double busy = 0;
+		double capacity = 0;
+		size_t peak = 0;
+
+		double voxelsPerSecond() const { return total > 0 ? voxels / total * 1e3 : 0; }
+		double utilization() const { return capacity > 0 ? busy / capacity : 0; }
+	};
+
+private:
+	mutable mutex lock;
+	vector<Event> events;
+	size_t capacity;
+	size_t recorded = 0;
+	atomic<bool> recording;
+	const chrono::steady_clock::time_point origin;
+
+public:
+	explicit VolumeTrace(size_t capacity)
+		: capacity(capacity), recording(false), origin(chrono::steady_clock::now()) {}
+
+	static VolumeTrace &instance() {
+		static VolumeTrace trace(1 << 16);
+		return trace;
+	}
+
+	bool enabled() const { return recording.load(memory_order_relaxed); }
+	void enabled(bool value) { recording = value; }
+
+	int64_t now() const {
+		return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - origin).count();
+	}
+
+	// small sequential id of the calling thread
+	static unsigned threadId() {
+		static atomic<unsigned> threads(0);
+		thread_local unsigned id = ++threads;
+		return id;
+	}
+
+	void record(Event &&event) {
+		lock_guard<mutex> locker(lock);
+		if (events.size() < capacity) {
+			events.push_back(std::move(event));
+		}
+		else {
+			events[recorded % capacity] = std::move(event);
+		}
+		recorded += 1;
+	}
+
+	void clear() {
+		lock_guard<mutex> locker(lock);
+		events.clear();
+		recorded = 0;
+	}
+
+	// the recorded events ordered by their end
+	vector<Event> snapshot() const {
+		lock_guard<mutex> locker(lock);
+		if (recorded <= capacity) {
+			return events;
+		}
+		vector<Event> result(events.begin() + recorded % capacity, events.end());
+		result.insert(result.end(), events.begin(), events.begin() + recorded % capacity);
+		return result;
+	}
+
+	// totals of the events with the same name, in the order of their first occurrence
+	vector<Summary> summary() const {
+		vector<Summary> result;
+		map<string, size_t> index;
+		for (const Event &event : snapshot()) {
+			auto it = index.find(event.name);
+			if (it == index.end()) {
+				it = index.insert(make_pair(event.name, result.size())).first;
+				result.push_back(Summary());
+				result.back().name = event.name;
+			}
+			Summary &summary = result[it->second];
+			double duration = event.duration / 1e3;
+			summary.count += 1;
+			summary.total += duration;
+			summary.max = duration > summary.max ? duration : summary.max;
+			summary.voxels += event.voxels;
+			summary.busy += event.busy;
+			summary.capacity += event.capacity;
+			summary.peak = event.peak > summary.peak ? event.peak : summary.peak;
+		}
+		return result;
+	}
+
+	// the events in the chrome trace event format
+	string chromeTrace() const {
+		ostringstream out;
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		bool first = true;
+		for (const Event &event : snapshot()) {
+			out << (first ? "\n" : ",\n");
+			out << "{\"name\":\"" << escape(event.name) << "\",\"cat\":\"volume\",\"ph\":\"X\"";
+			out << ",\"ts\":" << event.start << ",\"dur\":" << event.duration;
+			out << ",\"pid\":1,\"tid\":" << event.thread << ",\"args\":{";
+			out << "\"memory_mb\":" << event.memory / (1024. * 1024.);
+			if (event.peak > 0) {
+				out << ",\"peak_mb\":" << event.peak / (1024. * 1024.);
+			}
+			if (event.voxels > 0) {
+				out << ",\"voxels\":" << event.voxels;
+				out << ",\"mvoxels_per_s\":" << (event.duration > 0 ? event.voxels / event.duration : 0);
+			}
+			if (event.capacity > 0) {
+				out << ",\"utilization\":" << event.busy / event.capacity;
+			}
+			out << "}}";
+			first = false;
+		}
+		out << "\n]}\n";
+		return out.str();
+	}
+
+private:
+	static string escape(const string &value) {
+		string result;
+		for (char chr : value) {
+			if (chr == '"' || chr == '\\') {
+				result += '\\';
+			}
+			if ((unsigned char) chr >= ' ') {
+				result += chr;
+			}
+		}
+		return result;
+	}
+};
+
+/**
+ * Record the time between the construction and the destruction as an event of the trace.
+ * The parallel loops executed by the thread of the scope add their thread utilization to it,
+ * nested scopes add theirs to the enclosing one.
+ */
+class TraceScope {
+	TraceScope *parent;
+	const bool active;
+	string name;
+	int64_t start = 0;
+	double voxels;
+	double busy = 0;
+	double capacity = 0;
+	size_t peak = 0;
+
+	// the innermost scope of the calling thread
+	static TraceScope *&current() {
+		thread_local TraceScope *scope = nullptr;
+		return scope;
+	}
+
+public:
+	// the name is copied only while the trace is recording
+	explicit TraceScope(const char *name, double voxels = 0)
+		: parent(current()), active(VolumeTrace::instance().enabled()), voxels(voxels) {
+		if (!active) {
+			return;
+		}
+		this->name = name;
+		this->start = VolumeTrace::instance().now();
+		current() = this;
+	}
+
+	TraceScope(const TraceScope &) = delete;
+	TraceScope &operator=(const TraceScope &) = delete;
+
+	~TraceScope() {
+		if (!active) {
+			return;
+		}
+		current() = parent;
+		if (parent != nullptr) {
+			parent->busy += busy;
+			parent->capacity += capacity;
+		}
+
+		VolumeTrace &trace = VolumeTrace::instance();
+		trace.record(VolumeTrace::Event {
+			std::move(name), start, trace.now() - start, VolumeTrace::threadId(),
+			voxels, busy, capacity, VolumePool::instance().used(), peak
+		});
+	}
+
+	void addVoxels(double count) {
+		voxels += count;
+	}
+
+	// set the peak memory use, measured by the owner of the scope
+	void peakMemory(size_t bytes) {
+		peak = bytes;
+	}
+
+	// a parallel loop executed inside the innermost scope of the calling thread
+	static bool tracing() {
+		return current() != nullptr;
+	}
+	static void parallel(double busy, double capacity) {
+		TraceScope *scope = current();
+		if (scope != nullptr) {
+			scope->busy += busy;
+			scope->capacity += capacity;
+		}
+	}
+};
+
+#endif
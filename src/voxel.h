@@ -12,4 +12,14 @@ static inline byte toByte(float value) {
 	return (byte) (value * 255);
 }
 
+/**
+ * Weighted sum of voxels used when resampling. The voxels are summed directly by default,
+ * compact voxels specialize it to accumulate in full precision and convert the result once.
+ */
+template <class voxel> struct VoxelSum {
+	typedef voxel type;
+	static inline const voxel &load(const voxel &value) { return value; }
+	static inline const voxel &store(const voxel &value) { return value; }
+};
+
 #endif
@@ -58,6 +58,9 @@ struct float1 {
 	friend inline float1 operator *(float1 lhs, float1 rhs) {
 		return float1(lhs.value * rhs.value);
 	}
+	friend inline float1 operator *(float1 lhs, float rhs) {
+		return float1(lhs.value * rhs);
+	}
 	friend inline float1 operator /(float1 lhs, float1 rhs) {
 		return float1(lhs.value / rhs.value);
 	}
@@ -65,6 +65,16 @@ struct float4 {
 		this->w += (other.w - this->w) * alpha;
 	}
 
+	friend inline float4 operator *(float4 lhs, float rhs) {
+		return float4(lhs.x * rhs, lhs.y * rhs, lhs.z * rhs, lhs.w * rhs);
+	}
+	friend inline void operator +=(float4 &lhs, float4 rhs) {
+		lhs.x += rhs.x;
+		lhs.y += rhs.y;
+		lhs.z += rhs.z;
+		lhs.w += rhs.w;
+	}
+
 };
 
 #endif
@@ -0,0 +1,133 @@
+#ifndef VOXEL_NORMAL
+#define VOXEL_NORMAL
+
+#include "voxel.h"
+#include "voxel_float4.h"
+#include <cmath>
+#include <cstdint>
+
+using namespace std;
+
+/**
+ * Direction and magnitude of a gradient in 3 bytes instead of the 16 of a float4.
+ * The direction is octahedral encoded in 8 bits per axis, with the axes represented exactly,
+ * the magnitude is quantized in [0, 1] like the alpha of the rendered voxel.
+ * The decoded values come from tables built on first use, the conversions need no square roots.
+ * Resampling sums the decoded vectors in a float4 and encodes the result once (see VoxelSum).
+ */
+struct normal4 {
+	uint8_t u, v;
+	uint8_t magnitude;
+	static const normal4 zero;
+
+	// the code of the zero vector, which decodes to +z like the encoded ones
+	normal4() {
+		this->u = 127;
+		this->v = 127;
+		this->magnitude = 0;
+	}
+
+	// the direction of x, y, z with the magnitude w, like the float4 of the gradient
+	normal4(float x, float y, float z, float w) {
+		float sum = abs(x) + abs(y) + abs(z);
+		float ox = 0, oy = 0;
+		if (sum > 1e-20f) {
+			ox = x / sum;
+			oy = y / sum;
+			if (z < 0) {
+				float fx = (1 - abs(oy)) * (ox < 0 ? -1 : 1);
+				float fy = (1 - abs(ox)) * (oy < 0 ? -1 : 1);
+				ox = fx;
+				oy = fy;
+			}
+		}
+		this->u = (uint8_t) lround(ox * 127 + 127);
+		this->v = (uint8_t) lround(oy * 127 + 127);
+		this->magnitude = toByte(w + .5f / 255);
+	}
+
+	// unit direction of the code
+	inline const float *direction() const {
+		return table().direction[this->u << 8 | this->v];
+	}
+
+	inline float w() const {
+		return this->magnitude / 255.f;
+	}
+
+	inline int toRGBA(byte buff[4]) const {
+		const byte *rgb = table().rgb[this->u << 8 | this->v];
+		buff[0] = rgb[0];
+		buff[1] = rgb[1];
+		buff[2] = rgb[2];
+		buff[3] = this->magnitude;
+		return 1 + this->magnitude;
+	}
+
+	void mix(normal4 other, float alpha) {
+		const float *a = this->direction();
+		const float *b = other.direction();
+		float wa = this->w();
+		float wb = other.w();
+		float w = wa + (wb - wa) * alpha;
+		*this = normal4(
+			a[0] * wa + (b[0] * wb - a[0] * wa) * alpha,
+			a[1] * wa + (b[1] * wb - a[1] * wa) * alpha,
+			a[2] * wa + (b[2] * wb - a[2] * wa) * alpha,
+			w
+		);
+	}
+
+private:
+	struct Table {
+		float direction[1 << 16][3];
+		byte rgb[1 << 16][4];
+
+		Table() {
+			for (int u = 0; u < 256; ++u) {
+				for (int v = 0; v < 256; ++v) {
+					float x = (u - 127) / 127.f;
+					float y = (v - 127) / 127.f;
+					float z = 1 - abs(x) - abs(y);
+					if (z < 0) {
+						float fx = (1 - abs(y)) * (x < 0 ? -1 : 1);
+						float fy = (1 - abs(x)) * (y < 0 ? -1 : 1);
+						x = fx;
+						y = fy;
+					}
+					float len = sqrt(x * x + y * y + z * z);
+					float *d = direction[u << 8 | v];
+					d[0] = x / len;
+					d[1] = y / len;
+					d[2] = z / len;
+					// scale from [-1, 1) to [0, 1) like the float4
+					byte *c = rgb[u << 8 | v];
+					c[0] = toByte(d[0] / 2 + .5f);
+					c[1] = toByte(d[1] / 2 + .5f);
+					c[2] = toByte(d[2] / 2 + .5f);
+					c[3] = 0;
+				}
+			}
+		}
+	};
+
+	static const Table &table() {
+		static const Table *instance = new Table();
+		return *instance;
+	}
+};
+
+// the resampled gradients are summed as vectors, the magnitude is the length of the sum
+template <> struct VoxelSum<normal4> {
+	typedef float4 type;
+	static inline float4 load(const normal4 &value) {
+		const float *d = value.direction();
+		float w = value.w();
+		return float4(d[0] * w, d[1] * w, d[2] * w, w);
+	}
+	static inline normal4 store(const float4 &value) {
+		return normal4(value.x, value.y, value.z, sqrt(value.x * value.x + value.y * value.y + value.z * value.z));
+	}
+};
+
+#endif